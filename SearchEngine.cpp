@@ -1,12 +1,75 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <execution>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <random>
 #include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// GCC сворачивает умножение и сложение в FMA везде, где цель его допускает; ядра
+// подсчёта релевантности должны давать одинаковый результат при любой цели
+#if defined(__GNUC__) && !defined(__clang__)
+#define SEARCH_SERVER_EXACT_FP __attribute__((optimize("fp-contract=off")))
+#else
+#define SEARCH_SERVER_EXACT_FP
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_SERVER_X86_SIMD
+#define SEARCH_SERVER_TARGET(isa) __attribute__((target(isa))) SEARCH_SERVER_EXACT_FP
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define SEARCH_SERVER_X86_SIMD
+#define SEARCH_SERVER_TARGET(isa) SEARCH_SERVER_EXACT_FP
+#include <immintrin.h>
+#include <intrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SEARCH_SERVER_NEON_SIMD
+#include <arm_neon.h>
+#endif
+
 using namespace std;
 
 #define ASSERT(expr) (!!(expr), #expr, __FILE__, __FUNCTION__, __LINE__, ""s)
@@ -20,6 +83,45 @@ using namespace std;
 #define RUN_TEST(test) RunTest((test), #test) 
 
 const int MAX_RESULT_DOCUMENT_COUNT = 5;
+const double RELEVANCE_EPSILON = 1e-6;
+
+// Печатает, сколько прожил объект, при выходе из его области видимости
+class LogDuration {
+public:
+    using Clock = chrono::steady_clock;
+
+    explicit LogDuration(string_view id, ostream& out = cerr)
+        : id_(id)
+        , out_(out) {
+    }
+
+    LogDuration(const LogDuration&) = delete;
+    LogDuration& operator=(const LogDuration&) = delete;
+
+    ~LogDuration() {
+        const auto duration = Clock::now() - start_time_;
+        out_ << id_ << ": "s << chrono::duration_cast<chrono::milliseconds>(duration).count() << " ms"s << endl;
+    }
+
+private:
+    const string id_;
+    ostream& out_;
+    const Clock::time_point start_time_ = Clock::now();
+};
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profile_guard_, __LINE__)
+
+// Замеры в горячих местах печатаются в отладочной сборке и при SEARCH_SERVER_PROFILE,
+// в сборке с NDEBUG они исчезают целиком
+#if defined(NDEBUG) && !defined(SEARCH_SERVER_PROFILE)
+#define LOG_DURATION(id) static_cast<void>(0)
+#define LOG_DURATION_STREAM(id, out) static_cast<void>(0)
+#else
+#define LOG_DURATION(id) LogDuration UNIQUE_VAR_NAME_PROFILE(id)
+#define LOG_DURATION_STREAM(id, out) LogDuration UNIQUE_VAR_NAME_PROFILE(id, out)
+#endif
 
 string ReadLine() {
     string s;
@@ -34,461 +136,6137 @@ int ReadLineWithNumber() {
     return result;
 }
 
-vector<string> SplitIntoWords(const string& text) {
-    vector<string> words;
-    string word;
-    for (const char c : text) {
-        if (c == ' ') {
-            words.push_back(word);
-            word = "";
-        } else {
-            word += c;
+// Слова - непустые подстроки между пробелами; дописываются в words и ссылаются на text
+template <typename WordContainer>
+void SplitIntoWords(string_view text, WordContainer& words) {
+    while (true) {
+        const size_t space = text.find(' ');
+        if (space != 0 && !text.empty()) {
+            words.push_back(text.substr(0, space));
         }
+        if (space == text.npos) {
+            break;
+        }
+        text.remove_prefix(space + 1);
     }
-    words.push_back(word);
-    
+}
+
+vector<string_view> SplitIntoWords(string_view text) {
+    vector<string_view> words;
+    SplitIntoWords(text, words);
     return words;
 }
-    
-struct Document {
-    int id;
-    double relevance;
-    int rating;
+
+bool IsValidWord(string_view word) {
+    return none_of(word.begin(), word.end(), [](char c) {
+        return c >= '\0' && c < ' ';
+    });
+}
+
+bool IsValidQueryWord(string_view word) {
+    // Проверка на одинокий минус
+    if (word == "-") {
+        return false;
+    }
+    // Проверка на двойной минус
+    if (word.size() > 1 && word[0] == '-' && word[1] == '-') {
+        return false;
+    }
+    // Проверка на спец. символы
+    return IsValidWord(word);
+}
+
+// Фраза запроса: слова в порядке запроса без стоп-слов. Соседние слова фразы должны
+// стоять в документе в том же порядке, и между ними может быть не больше max_gap слов
+struct QueryPhrase {
+    vector<string_view> words;
+    uint32_t max_gap = 0;
 };
 
-enum class DocumentStatus {
-    ACTUAL,
-    IRRELEVANT,
-    BANNED,
-    REMOVED,
+// Разобранный и проверенный запрос, который можно переиспользовать между вызовами.
+// Слова ссылаются на текст запроса, поэтому текст должен жить дольше объекта.
+// Слова отсортированы и не повторяются, стоп-слова отброшены. Слова фраз входят
+// в plus_words и ранжируются как обычные плюс-слова, слова минус-фраз - никуда
+struct Query {
+    vector<string_view> plus_words;
+    vector<string_view> minus_words;
+    // Документ должен содержать каждую фразу из phrases и ни одной из minus_phrases
+    vector<QueryPhrase> phrases;
+    vector<QueryPhrase> minus_phrases;
 };
 
-class SearchServer {
-public:
-    
-    inline static constexpr int INVALID_DOCUMENT_ID = -1;
+inline bool HasPhrases(const Query& query) {
+    return !query.phrases.empty() || !query.minus_phrases.empty();
+}
 
-    SearchServer() = default;
-    
-    template <typename StringContainer>
-    explicit SearchServer(const StringContainer& stop_words) {
-        set<string> unique_words;
-        for (const string& word : stop_words) {
-            if (!IsValidWord(word)) {
-                throw invalid_argument("Стоп слова не должны содержать недопустимые символы"); 
-            } else {
-                unique_words.insert(word);
+struct QueryWord {
+    string_view data;
+    bool is_minus;
+};
+
+// Word shouldn't be empty
+QueryWord ParseQueryWord(string_view text) {
+    if (!IsValidQueryWord(text)) {
+        throw invalid_argument("Поиск не должен содержать недопустимых символов, болтающихся маркеров или двойных '-'.");
+    }
+    bool is_minus = false;
+    if (text[0] == '-') {
+        is_minus = true;
+        text.remove_prefix(1);
+    }
+    return {text, is_minus};
+}
+
+void SortUnique(vector<string_view>& words) {
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+}
+
+bool IsQueryPhraseStart(string_view word) {
+    return word.substr(0, 1) == "\"" || word.substr(0, 2) == "-\"";
+}
+
+// Фраза в кавычках: "пушистый кот" или -"пушистый кот". За закрывающей кавычкой может
+// стоять ~N - сколько других слов допускается между соседними словами фразы.
+// Возвращает слово запроса, следующее за фразой
+template <typename WordIterator, typename StopWordPredicate>
+WordIterator ParseQueryPhrase(WordIterator it, WordIterator end, StopWordPredicate is_stop_word, Query& query) {
+    string_view word = *it;
+    const bool is_minus = word[0] == '-';
+    word.remove_prefix(is_minus ? 2 : 1);
+    QueryPhrase phrase;
+    size_t word_count = 0;
+    while (true) {
+        const size_t quote = word.find('"');
+        const string_view phrase_word = word.substr(0, quote);
+        if (!phrase_word.empty()) {
+            if (phrase_word[0] == '-' || !IsValidWord(phrase_word)) {
+                throw invalid_argument("Поиск не должен содержать недопустимых символов, болтающихся маркеров или двойных '-'.");
+            }
+            ++word_count;
+            if (!is_stop_word(phrase_word)) {
+                phrase.words.push_back(phrase_word);
+            }
+        }
+        if (quote != word.npos) {
+            const string_view suffix = word.substr(quote + 1);
+            if (!suffix.empty()) {
+                const char* const suffix_end = suffix.data() + suffix.size();
+                if (suffix.size() < 2 || suffix[0] != '~'
+                    || from_chars(suffix.data() + 1, suffix_end, phrase.max_gap).ptr != suffix_end) {
+                    throw invalid_argument("После фразы может стоять только ~ и число слов между её словами");
+                }
             }
+            break;
         }
-        stop_words_ = unique_words;
+        if (++it == end) {
+            throw invalid_argument("Фраза в запросе должна заканчиваться кавычкой");
+        }
+        word = *it;
     }
-
-    explicit SearchServer(const string& stop_words_text)  {
-        if (!CheckQueryValidity(stop_words_text)) {
-           throw invalid_argument("Стоп слова не должны содержать недопустимые символы"); 
+    if (word_count == 0) {
+        throw invalid_argument("Фраза в запросе не должна быть пустой");
+    }
+    if (!phrase.words.empty()) {
+        if (!is_minus) {
+            query.plus_words.insert(query.plus_words.end(), phrase.words.begin(), phrase.words.end());
         }
-        stop_words_ = MakeUniqueSet(SplitIntoWords(stop_words_text));
+        (is_minus ? query.minus_phrases : query.phrases).push_back(move(phrase));
     }
+    return ++it;
+}
 
-    void AddDocument(int document_id, const string& document, DocumentStatus status, const vector<int>& ratings) {
-        // Проверка на отрицательный id и на существующий id
-        if (document_id < 0 || documents_.count(document_id)) {
-            throw invalid_argument("Нельзя добавлять документы с отрицательным id или уже существуюищим id");
+// Разбор и проверка уже разбитого на слова запроса
+template <typename WordRange, typename StopWordPredicate>
+Query ParseQueryWords(const WordRange& words, StopWordPredicate is_stop_word) {
+    Query query;
+    for (auto it = begin(words); it != end(words);) {
+        if (IsQueryPhraseStart(*it)) {
+            it = ParseQueryPhrase(it, end(words), is_stop_word, query);
+            continue;
         }
-        
-        if (!CheckQueryValidity(document)) {
-            throw invalid_argument("Нельзя использовать недопустимые символы в документах");
+        const string_view word = *it++;
+        const QueryWord query_word = ParseQueryWord(word);
+        if (!is_stop_word(query_word.data)) {
+            if (query_word.is_minus) {
+                query.minus_words.push_back(query_word.data);
+            } else {
+                query.plus_words.push_back(query_word.data);
+            }
         }
-        
-        const vector<string> words = SplitIntoWordsNoStop(document);
-        const double inv_word_count = 1.0 / words.size();
-        for (const string& word : words) {
-            word_to_document_freqs_[word][document_id] += inv_word_count;
+    }
+    SortUnique(query.plus_words);
+    SortUnique(query.minus_words);
+    return query;
+}
+
+// Разбор и проверка запроса за один проход по его тексту
+template <typename StopWordPredicate>
+Query ParseQuery(string_view raw_query, StopWordPredicate is_stop_word) {
+    return ParseQueryWords(SplitIntoWords(raw_query), is_stop_word);
+}
+
+// Вызывает function(i) для каждого i из [0, count) параллельно. Исключение внутри
+// параллельного алгоритма завершило бы программу, поэтому исключения вызовов
+// собираются, и после завершения всех вызовов выбрасывается первое по номеру
+template <typename Function>
+void ForEachIndexParallel(size_t count, Function function) {
+    vector<exception_ptr> errors(count);
+    vector<size_t> indexes(count);
+    iota(indexes.begin(), indexes.end(), 0);
+    for_each(execution::par, indexes.begin(), indexes.end(), [&](size_t i) {
+        try {
+            function(i);
+        } catch (...) {
+            errors[i] = current_exception();
         }
-        documents_.emplace(document_id, DocumentData{ComputeAverageRating(ratings), status});
-        document_list_.push_back(document_id); // Храним порядок id
+    });
+    for (const exception_ptr& error : errors) {
+        if (error != nullptr) {
+            rethrow_exception(error);
+        }
+    }
+}
+
+// Словарь, разбитый на независимые корзины со своими мьютексами:
+// потоки, работающие с разными корзинами, не мешают друг другу
+template <typename Key, typename Value>
+class ConcurrentMap {
+public:
+    static_assert(is_integral_v<Key>, "ConcurrentMap supports only integer keys");
+
+    struct Access {
+        lock_guard<mutex> guard;
+        Value& ref_to_value;
+    };
+
+    explicit ConcurrentMap(size_t bucket_count) : buckets_(bucket_count) {
     }
 
-    template <typename DocumentPredicate>
-     vector<Document> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate) const {
-        
-        if (!CheckQueryValidity(raw_query)) {
-            throw invalid_argument("Поиск не должен содержать недопустимых символов, болтающихся маркеров или двойных '-'.");
+    Access operator[](const Key& key) {
+        Bucket& bucket = GetBucket(key);
+        return {lock_guard(bucket.values_mutex), bucket.values[key]};
+    }
+
+    void Erase(const Key& key) {
+        Bucket& bucket = GetBucket(key);
+        lock_guard guard(bucket.values_mutex);
+        bucket.values.erase(key);
+    }
+
+    map<Key, Value> BuildOrdinaryMap() {
+        map<Key, Value> result;
+        for (Bucket& bucket : buckets_) {
+            lock_guard guard(bucket.values_mutex);
+            result.insert(bucket.values.begin(), bucket.values.end());
         }
-        
-        const Query query = ParseQuery(raw_query);
-        auto matched_documents = FindAllDocuments(query, document_predicate);
+        return result;
+    }
 
-        sort(matched_documents.begin(), matched_documents.end(), [](const Document& lhs, const Document& rhs) {
-            if (abs(lhs.relevance - rhs.relevance) < 1e-6) {
-                return lhs.rating > rhs.rating;
-            } else {
-                return lhs.relevance > rhs.relevance;
-            }
+private:
+    struct Bucket {
+        mutex values_mutex;
+        map<Key, Value> values;
+    };
+
+    vector<Bucket> buckets_;
+
+    Bucket& GetBucket(const Key& key) {
+        return buckets_[static_cast<uint64_t>(key) % buckets_.size()];
+    }
+};
+
+// Очередь ограниченной длины между потоками конвейера: Push ждёт, пока в очереди
+// не освободится место, Pop - пока не появится элемент. После Close очередь отдаёт
+// оставшиеся элементы и затем nullopt; Cancel вдобавок выбрасывает их и отклоняет Push,
+// чтобы остановить поставщиков, когда потребитель упал
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(max<size_t>(1, capacity)) {
+    }
+
+    // false, если очередь отменена
+    bool Push(T value) {
+        unique_lock lock(queue_mutex_);
+        not_full_.wait(lock, [this] {
+            return values_.size() < capacity_ || is_cancelled_;
         });
-        if (matched_documents.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
+        if (is_cancelled_) {
+            return false;
         }
-        return matched_documents;
+        values_.push_back(move(value));
+        not_empty_.notify_one();
+        return true;
     }
 
-    vector<Document> FindTopDocuments(const string& raw_query, DocumentStatus status) const {
-        return FindTopDocuments(raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-            return document_status == status;
+    optional<T> Pop() {
+        unique_lock lock(queue_mutex_);
+        not_empty_.wait(lock, [this] {
+            return !values_.empty() || is_closed_;
         });
+        if (values_.empty()) {
+            return nullopt;
+        }
+        T value = move(values_.front());
+        values_.pop_front();
+        not_full_.notify_one();
+        return value;
     }
 
-    vector<Document> FindTopDocuments(const string& raw_query) const {
-        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    void Close() {
+        lock_guard guard(queue_mutex_);
+        is_closed_ = true;
+        not_empty_.notify_all();
     }
 
-    int GetDocumentCount() const {
-        return documents_.size();
+    void Cancel() {
+        lock_guard guard(queue_mutex_);
+        is_closed_ = true;
+        is_cancelled_ = true;
+        values_.clear();
+        not_empty_.notify_all();
+        not_full_.notify_all();
     }
 
-    tuple<vector<string>, DocumentStatus> MatchDocument(const string& raw_query, int document_id) const {
-        
-        if (!CheckQueryValidity(raw_query)) {
-            throw invalid_argument("Поиск не должен содержать недопустимых символов, болтающихся маркеров или двойных '-'.");
+private:
+    const size_t capacity_;
+    mutex queue_mutex_;
+    condition_variable not_full_;
+    condition_variable not_empty_;
+    deque<T> values_;
+    bool is_closed_ = false;
+    bool is_cancelled_ = false;
+};
+
+struct Document {
+    int id;
+    double relevance;
+    int rating;
+};
+
+// Порядок выдачи: по убыванию релевантности, при почти равной релевантности - по убыванию рейтинга
+inline bool IsMoreRelevant(const Document& lhs, const Document& rhs) {
+    if (abs(lhs.relevance - rhs.relevance) < RELEVANCE_EPSILON) {
+        return lhs.rating > rhs.rating;
+    } else {
+        return lhs.relevance > rhs.relevance;
+    }
+}
+
+// Оставляет в documents max_count лучших документов в порядке выдачи.
+// Полная сортировка не нужна: достаточно упорядочить первые max_count элементов
+template <typename ExecutionPolicy, typename DocumentContainer>
+void KeepTopDocuments(ExecutionPolicy&& policy, DocumentContainer& documents, size_t max_count) {
+    if (documents.size() > max_count) {
+        partial_sort(policy, documents.begin(), documents.begin() + max_count, documents.end(), IsMoreRelevant);
+        documents.resize(max_count);
+    } else {
+        sort(policy, documents.begin(), documents.end(), IsMoreRelevant);
+    }
+}
+
+// Ядра подсчёта релевантности: scores[ordinals[i]] += term_freqs[i] * idf и отметка найденных
+// документов в is_matched. Номера в одном списке вхождений различны, поэтому векторная
+// сборка и запись по этим номерам не пересекаются. Сложение и умножение идут отдельно,
+// без FMA: результат побитно совпадает со скалярным вариантом на любой машине
+using AccumulateScoresKernel = void (*)(const uint32_t* ordinals, const double* term_freqs, size_t count,
+                                        double inverse_document_freq, double* scores, char* is_matched);
+// Номера ненулевых байт is_matched[0, count) дописываются в ordinals по возрастанию
+using CollectMatchedKernel = void (*)(const char* is_matched, size_t count, pmr::vector<uint32_t>& ordinals);
+
+SEARCH_SERVER_EXACT_FP
+inline void AccumulateScoresScalar(const uint32_t* ordinals, const double* term_freqs, size_t count,
+                                   double inverse_document_freq, double* scores, char* is_matched) {
+    for (size_t i = 0; i < count; ++i) {
+        scores[ordinals[i]] += term_freqs[i] * inverse_document_freq;
+        is_matched[ordinals[i]] = true;
+    }
+}
+
+// Восемь флагов читаются одним 64-битным словом, нулевые слова пропускаются целиком
+inline void CollectMatchedScalar(const char* is_matched, size_t count, pmr::vector<uint32_t>& ordinals) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t)) {
+        uint64_t flags;
+        memcpy(&flags, is_matched + i, sizeof(flags));
+        if (flags == 0) {
+            continue;
         }
-        const Query query = ParseQuery(raw_query);
-        vector<string> matched_words;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.push_back(word);
+        for (size_t j = i; j < i + sizeof(uint64_t); ++j) {
+            if (is_matched[j]) {
+                ordinals.push_back(static_cast<uint32_t>(j));
             }
         }
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.clear();
-                break;
-            }
+    }
+    for (; i < count; ++i) {
+        if (is_matched[i]) {
+            ordinals.push_back(static_cast<uint32_t>(i));
         }
-        // result = {matched_words, documents_.at(document_id).status};
-        return {matched_words, documents_.at(document_id).status};
     }
-    
-    int GetDocumentId(int index) const {
-        return document_list_.at(index);
+}
+
+#ifdef SEARCH_SERVER_X86_SIMD
+inline uint32_t CountTrailingZeros(uint32_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
+
+SEARCH_SERVER_TARGET("avx2")
+inline void AccumulateScoresAvx2(const uint32_t* ordinals, const double* term_freqs, size_t count,
+                                 double inverse_document_freq, double* scores, char* is_matched) {
+    const __m256d idf = _mm256_set1_pd(inverse_document_freq);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ordinals + i));
+        const __m256d old_scores = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), scores, index,
+                                                            _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), sizeof(double));
+        const __m256d new_scores = _mm256_add_pd(old_scores, _mm256_mul_pd(_mm256_loadu_pd(term_freqs + i), idf));
+        // В AVX2 нет векторной записи по индексам
+        alignas(32) double result[4];
+        _mm256_store_pd(result, new_scores);
+        for (size_t j = 0; j < 4; ++j) {
+            scores[ordinals[i + j]] = result[j];
+            is_matched[ordinals[i + j]] = true;
+        }
     }
+    AccumulateScoresScalar(ordinals + i, term_freqs + i, count - i, inverse_document_freq, scores, is_matched);
+}
 
-private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
-    };
-    set<string> stop_words_;
-    map<string, map<int, double>> word_to_document_freqs_;
-    map<int, DocumentData> documents_;
-    vector<int> document_list_;
-    
-    static bool IsValidWord(const string& word) {
-        return none_of(word.begin(), word.end(), [](char c) {
-            return c >= '\0' && c < ' ';
-        });
+SEARCH_SERVER_TARGET("avx512f")
+inline void AccumulateScoresAvx512(const uint32_t* ordinals, const double* term_freqs, size_t count,
+                                   double inverse_document_freq, double* scores, char* is_matched) {
+    const __m512d idf = _mm512_set1_pd(inverse_document_freq);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ordinals + i));
+        const __m512d old_scores = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, index, scores, sizeof(double));
+        const __m512d new_scores = _mm512_add_pd(old_scores, _mm512_mul_pd(_mm512_loadu_pd(term_freqs + i), idf));
+        _mm512_i32scatter_pd(scores, index, new_scores, sizeof(double));
+        for (size_t j = 0; j < 8; ++j) {
+            is_matched[ordinals[i + j]] = true;
+        }
     }
+    AccumulateScoresScalar(ordinals + i, term_freqs + i, count - i, inverse_document_freq, scores, is_matched);
+}
 
-    static bool CheckQueryValidity (const string& raw_query){
-        bool answer = true;
-        for (const string& word : SplitIntoWords(raw_query)) {
-            // Проверка на одинокий минус
-            if (word == "-") {
-                answer = false;
-                break;
-            }
-            // Проверка на двойной минус
-            if (word[0] == '-' && word[1] == '-') {
-                answer = false;
-                break;
-            }
-            // Проверка на спец. символы
-            if (!IsValidWord(word)) {
-                // cout << word << ' ' << IsValidWord(word) << endl;
-                answer = false;
-                break;
+// 32 флага за сравнение: маска ненулевых байт перебирается по установленным битам
+SEARCH_SERVER_TARGET("avx2")
+inline void CollectMatchedAvx2(const char* is_matched, size_t count, pmr::vector<uint32_t>& ordinals) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i flags = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(is_matched + i));
+        uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(flags, zero)));
+        for (; mask != 0; mask &= mask - 1) {
+            ordinals.push_back(static_cast<uint32_t>(i) + CountTrailingZeros(mask));
+        }
+    }
+    const size_t first_tail = ordinals.size();
+    CollectMatchedScalar(is_matched + i, count - i, ordinals);
+    for (size_t j = first_tail; j < ordinals.size(); ++j) {
+        ordinals[j] += static_cast<uint32_t>(i);
+    }
+}
+
+enum class SimdLevel {
+    SCALAR,
+    AVX2,
+    AVX512,
+};
+
+// Набор команд определяется по процессору и поддержке регистров ОС
+inline SimdLevel DetectSimdLevel() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return SimdLevel::SCALAR;
+    }
+    __cpuid(info, 1);
+    const bool has_os_xsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+    if (!has_os_xsave) {
+        return SimdLevel::SCALAR;
+    }
+    const unsigned long long enabled_state = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if ((enabled_state & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0) {
+        return SimdLevel::AVX512;
+    }
+    if ((enabled_state & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SCALAR;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SCALAR;
+#endif
+}
+#endif
+
+#ifdef SEARCH_SERVER_NEON_SIMD
+// В NEON нет сборки по индексам: векторно считаются только произведения
+SEARCH_SERVER_EXACT_FP
+inline void AccumulateScoresNeon(const uint32_t* ordinals, const double* term_freqs, size_t count,
+                                 double inverse_document_freq, double* scores, char* is_matched) {
+    const float64x2_t idf = vdupq_n_f64(inverse_document_freq);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const float64x2_t products = vmulq_f64(vld1q_f64(term_freqs + i), idf);
+        scores[ordinals[i]] += vgetq_lane_f64(products, 0);
+        scores[ordinals[i + 1]] += vgetq_lane_f64(products, 1);
+        is_matched[ordinals[i]] = true;
+        is_matched[ordinals[i + 1]] = true;
+    }
+    AccumulateScoresScalar(ordinals + i, term_freqs + i, count - i, inverse_document_freq, scores, is_matched);
+}
+
+// 16 флагов за сравнение; нулевые блоки пропускаются по максимуму байт
+inline void CollectMatchedNeon(const char* is_matched, size_t count, pmr::vector<uint32_t>& ordinals) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(is_matched + i))) == 0) {
+            continue;
+        }
+        for (size_t j = i; j < i + 16; ++j) {
+            if (is_matched[j]) {
+                ordinals.push_back(static_cast<uint32_t>(j));
             }
         }
-        return answer;
     }
-    
-    template <typename StringContainer>
-    set<string> MakeUniqueSet(const StringContainer& container) {
-        set<string> unique_set;
-        for (const string& word : container) {
-            unique_set.insert(word);
+    const size_t first_tail = ordinals.size();
+    CollectMatchedScalar(is_matched + i, count - i, ordinals);
+    for (size_t j = first_tail; j < ordinals.size(); ++j) {
+        ordinals[j] += static_cast<uint32_t>(i);
+    }
+}
+#endif
+
+// Ядра выбираются один раз, при первом поиске
+inline AccumulateScoresKernel GetAccumulateScoresKernel() {
+#if defined(SEARCH_SERVER_X86_SIMD)
+    static const AccumulateScoresKernel kernel = [] {
+        switch (DetectSimdLevel()) {
+        case SimdLevel::AVX512:
+            return &AccumulateScoresAvx512;
+        case SimdLevel::AVX2:
+            return &AccumulateScoresAvx2;
+        default:
+            return &AccumulateScoresScalar;
         }
-        return unique_set;
+    }();
+    return kernel;
+#elif defined(SEARCH_SERVER_NEON_SIMD)
+    return &AccumulateScoresNeon;
+#else
+    return &AccumulateScoresScalar;
+#endif
+}
+
+inline CollectMatchedKernel GetCollectMatchedKernel() {
+#if defined(SEARCH_SERVER_X86_SIMD)
+    static const CollectMatchedKernel kernel = DetectSimdLevel() == SimdLevel::SCALAR
+        ? &CollectMatchedScalar : &CollectMatchedAvx2;
+    return kernel;
+#elif defined(SEARCH_SERVER_NEON_SIMD)
+    return &CollectMatchedNeon;
+#else
+    return &CollectMatchedScalar;
+#endif
+}
+
+enum class DocumentStatus {
+    ACTUAL,
+    IRRELEVANT,
+    BANNED,
+    REMOVED,
+};
+
+// Готовые предикаты для FindTopDocuments. Как и лямбды, их можно вызвать с (id, статус,
+// рейтинг), но SearchServer узнаёт их тип при компиляции и фильтрует без вызова:
+// StatusIs - по битовой карте статуса, RatingAtLeast - читая только рейтинги, AcceptAll
+// не фильтрует вовсе
+template <DocumentStatus Status>
+struct StatusIs {
+    static constexpr DocumentStatus STATUS = Status;
+
+    bool operator()(int, DocumentStatus status, int) const {
+        return status == Status;
     }
+};
 
-    bool IsStopWord(const string& word) const {
-        return stop_words_.count(word) > 0;
+struct AcceptAll {
+    bool operator()(int, DocumentStatus, int) const {
+        return true;
     }
+};
 
-    vector<string> SplitIntoWordsNoStop(const string& text) const {
-        vector<string> words;
-        for (const string& word : SplitIntoWords(text)) {
-            if (!IsStopWord(word)) {
-                words.push_back(word);
-            }
+template <int MinRating>
+struct RatingAtLeast {
+    static constexpr int MIN_RATING = MinRating;
+
+    bool operator()(int, DocumentStatus, int rating) const {
+        return rating >= MinRating;
+    }
+};
+
+template <typename DocumentPredicate>
+inline constexpr bool IS_STATUS_PREDICATE = false;
+
+template <DocumentStatus Status>
+inline constexpr bool IS_STATUS_PREDICATE<StatusIs<Status>> = true;
+
+template <typename DocumentPredicate>
+inline constexpr bool IS_RATING_PREDICATE = false;
+
+template <int MinRating>
+inline constexpr bool IS_RATING_PREDICATE<RatingAtLeast<MinRating>> = true;
+
+// Документ для пакетного добавления; текст должен жить до конца вызова AddDocuments
+struct RawDocument {
+    int id;
+    string_view text;
+    DocumentStatus status;
+    vector<int> ratings;
+};
+
+inline constexpr size_t DOCUMENT_STATUS_COUNT = 4;
+
+// Множество документов в виде битовой карты по внутренним номерам документов сервера.
+// Пересечение карт идёт по 64 документа за операцию
+class DocumentMask {
+public:
+    DocumentMask() = default;
+
+    explicit DocumentMask(size_t size)
+        : words_((size + WORD_BITS - 1) / WORD_BITS) {
+    }
+
+    bool Test(uint32_t ordinal) const {
+        const size_t word = ordinal / WORD_BITS;
+        return word < words_.size() && (words_[word] >> (ordinal % WORD_BITS) & 1u);
+    }
+
+    void Set(uint32_t ordinal) {
+        const size_t word = ordinal / WORD_BITS;
+        if (word >= words_.size()) {
+            words_.resize(word + 1);
         }
-        return words;
+        words_[word] |= uint64_t{1} << (ordinal % WORD_BITS);
     }
 
-    static int ComputeAverageRating(const vector<int>& ratings) {
-        if (ratings.empty()) {
-            return 0;
+    void Reset(uint32_t ordinal) {
+        const size_t word = ordinal / WORD_BITS;
+        if (word < words_.size()) {
+            words_[word] &= ~(uint64_t{1} << (ordinal % WORD_BITS));
         }
-        int rating_sum = 0;
-        for (const int rating : ratings) {
-            rating_sum += rating;
+    }
+
+    DocumentMask& operator&=(const DocumentMask& other) {
+        if (words_.size() > other.words_.size()) {
+            words_.resize(other.words_.size());
         }
-        return rating_sum / static_cast<int>(ratings.size());
+        for (size_t i = 0; i < words_.size(); ++i) {
+            words_[i] &= other.words_[i];
+        }
+        return *this;
+    }
+
+    DocumentMask& operator|=(const DocumentMask& other) {
+        if (words_.size() < other.words_.size()) {
+            words_.resize(other.words_.size());
+        }
+        for (size_t i = 0; i < other.words_.size(); ++i) {
+            words_[i] |= other.words_[i];
+        }
+        return *this;
+    }
+
+    size_t Count() const {
+        size_t count = 0;
+        for (uint64_t word : words_) {
+            for (; word != 0; word &= word - 1) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+private:
+    static constexpr size_t WORD_BITS = 64;
+
+    vector<uint64_t> words_;
+};
+
+inline DocumentMask operator&(DocumentMask lhs, const DocumentMask& rhs) {
+    lhs &= rhs;
+    return lhs;
+}
+
+inline DocumentMask operator|(DocumentMask lhs, const DocumentMask& rhs) {
+    lhs |= rhs;
+    return lhs;
+}
+
+// Неизменяемое множество стоп-слов: отсортированный список слов и хеш-таблица с открытой
+// адресацией поверх него. Прежде чем считать хеш, слово проверяется по битовым картам
+// длин и первых байт стоп-слов - большинство обычных слов отсеивается уже там
+class StopWordSet {
+public:
+    StopWordSet() = default;
+
+    template <typename StringContainer>
+    explicit StopWordSet(const StringContainer& words) {
+        for (const auto& word : words) {
+            words_.emplace_back(word);
+        }
+        sort(words_.begin(), words_.end());
+        words_.erase(unique(words_.begin(), words_.end()), words_.end());
+
+        // Таблица заполнена не больше чем наполовину, так что цепочки проб короткие
+        size_t slot_count = 1;
+        while (slot_count < words_.size() * 2) {
+            slot_count *= 2;
+        }
+        slots_.assign(words_.empty() ? 0 : slot_count, EMPTY_SLOT);
+        for (uint32_t index = 0; index < words_.size(); ++index) {
+            const string_view word = words_[index];
+            length_mask_ |= GetLengthBit(word.size());
+            if (!word.empty()) {
+                first_byte_mask_[static_cast<uint8_t>(word[0]) / 64] |= uint64_t{1} << (static_cast<uint8_t>(word[0]) % 64);
+            }
+            size_t slot = Hash(word) & (slots_.size() - 1);
+            while (slots_[slot] != EMPTY_SLOT) {
+                slot = (slot + 1) & (slots_.size() - 1);
+            }
+            slots_[slot] = index;
+        }
+    }
+
+    bool Contains(string_view word) const {
+        if ((length_mask_ & GetLengthBit(word.size())) == 0) {
+            return false;
+        }
+        if (!word.empty() && (first_byte_mask_[static_cast<uint8_t>(word[0]) / 64] >> (static_cast<uint8_t>(word[0]) % 64) & 1u) == 0) {
+            return false;
+        }
+        for (size_t slot = Hash(word) & (slots_.size() - 1); slots_[slot] != EMPTY_SLOT; slot = (slot + 1) & (slots_.size() - 1)) {
+            if (words_[slots_[slot]] == word) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() const {
+        return words_.size();
+    }
+
+    // Слова перечисляются по возрастанию - в этом порядке они пишутся в снимок индекса
+    auto begin() const {
+        return words_.begin();
+    }
+
+    auto end() const {
+        return words_.end();
+    }
+
+private:
+    static constexpr uint32_t EMPTY_SLOT = numeric_limits<uint32_t>::max();
+
+    // Длины от 63 байт и больше делят один бит
+    static uint64_t GetLengthBit(size_t length) {
+        return uint64_t{1} << min<size_t>(length, 63);
+    }
+
+    // FNV-1a: слова короткие, и побайтовый хеш здесь не медленнее общих реализаций
+    static size_t Hash(string_view word) {
+        uint64_t hash = 14695981039346656037ull;
+        for (const char c : word) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+
+    vector<string> words_;
+    vector<uint32_t> slots_;
+    uint64_t length_mask_ = 0;
+    uint64_t first_byte_mask_[4] = {};
+};
+
+// Сжатый список вхождений слова: внутренние номера документов по возрастанию и число
+// вхождений слова в каждый документ. Вхождения хранятся блоками по BLOCK_SIZE: разности
+// соседних номеров упакованы в биты одинаковой для блока ширины, числа вхождений записаны
+// varint. Для каждого блока хранятся границы номеров и верхняя граница TF, чтобы поиск
+// номера и отсечение по релевантности не распаковывали лишние блоки. Последние
+// вхождения копятся в несжатом хвосте, пока не наберётся целый блок
+class PostingList {
+public:
+    static constexpr size_t BLOCK_SIZE = 128;
+
+    struct BlockInfo {
+        uint32_t first_ordinal;
+        uint32_t last_ordinal;
+        uint32_t size;
+        // Не меньше TF любого вхождения блока
+        double max_term_freq;
+    };
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    bool IsEmpty() const {
+        return size_ == 0;
+    }
+
+    // Номер должен быть больше всех номеров списка
+    void Add(uint32_t ordinal, uint32_t term_count, double term_freq) {
+        tail_ordinals_.push_back(ordinal);
+        tail_term_counts_.push_back(term_count);
+        tail_max_term_freq_ = max(tail_max_term_freq_, term_freq);
+        ++size_;
+        if (tail_ordinals_.size() == BLOCK_SIZE) {
+            blocks_.push_back(EncodeBlock(tail_ordinals_.data(), tail_term_counts_.data(), BLOCK_SIZE,
+                                          tail_max_term_freq_, data_));
+            tail_ordinals_.clear();
+            tail_term_counts_.clear();
+            tail_max_term_freq_ = 0.0;
+        }
+    }
+
+    void Erase(uint32_t ordinal) {
+        if (!tail_ordinals_.empty() && tail_ordinals_.front() <= ordinal) {
+            const auto it = lower_bound(tail_ordinals_.begin(), tail_ordinals_.end(), ordinal);
+            if (it != tail_ordinals_.end() && *it == ordinal) {
+                tail_term_counts_.erase(tail_term_counts_.begin() + (it - tail_ordinals_.begin()));
+                tail_ordinals_.erase(it);
+                --size_;
+            }
+            return;
+        }
+        const size_t block_index = FindBlock(ordinal);
+        if (block_index == blocks_.size()) {
+            return;
+        }
+        uint32_t ordinals[BLOCK_SIZE];
+        uint32_t term_counts[BLOCK_SIZE];
+        const size_t block_size = DecodeBlock(block_index, ordinals, term_counts);
+        const auto it = lower_bound(ordinals, ordinals + block_size, ordinal);
+        if (it == ordinals + block_size || *it != ordinal) {
+            return;
+        }
+        const size_t position = it - ordinals;
+        copy(ordinals + position + 1, ordinals + block_size, ordinals + position);
+        copy(term_counts + position + 1, term_counts + block_size, term_counts + position);
+        --size_;
+
+        // Блок перекодируется на месте, остальные блоки сдвигаются на изменение его длины.
+        // Прежняя граница TF остаётся верхней границей для оставшихся вхождений
+        const Block old_block = blocks_[block_index];
+        const size_t old_end = block_index + 1 < blocks_.size() ? blocks_[block_index + 1].offset : data_.size();
+        vector<uint8_t> encoded;
+        const bool is_block_empty = block_size == 1;
+        if (!is_block_empty) {
+            blocks_[block_index] = EncodeBlock(ordinals, term_counts, block_size - 1,
+                                               old_block.info.max_term_freq, encoded);
+            blocks_[block_index].offset = old_block.offset;
+        }
+        data_.erase(data_.begin() + old_block.offset, data_.begin() + old_end);
+        data_.insert(data_.begin() + old_block.offset, encoded.begin(), encoded.end());
+        const ptrdiff_t shift = static_cast<ptrdiff_t>(encoded.size()) - static_cast<ptrdiff_t>(old_end - old_block.offset);
+        for (size_t i = block_index + 1; i < blocks_.size(); ++i) {
+            blocks_[i].offset = static_cast<uint32_t>(blocks_[i].offset + shift);
+        }
+        if (is_block_empty) {
+            blocks_.erase(blocks_.begin() + block_index);
+        }
+    }
+
+    bool Contains(uint32_t ordinal) const {
+        if (!tail_ordinals_.empty() && tail_ordinals_.front() <= ordinal) {
+            return binary_search(tail_ordinals_.begin(), tail_ordinals_.end(), ordinal);
+        }
+        const size_t block_index = FindBlock(ordinal);
+        if (block_index == blocks_.size()) {
+            return false;
+        }
+        uint32_t ordinals[BLOCK_SIZE];
+        uint32_t term_counts[BLOCK_SIZE];
+        const size_t block_size = DecodeBlock(block_index, ordinals, term_counts);
+        return binary_search(ordinals, ordinals + block_size, ordinal);
+    }
+
+    // Сжатые блоки и несжатый хвост; хвост идёт последним блоком
+    size_t GetBlockCount() const {
+        return blocks_.size() + (tail_ordinals_.empty() ? 0 : 1);
+    }
+
+    BlockInfo GetBlockInfo(size_t block_index) const {
+        if (block_index < blocks_.size()) {
+            return blocks_[block_index].info;
+        }
+        return {tail_ordinals_.front(), tail_ordinals_.back(), static_cast<uint32_t>(tail_ordinals_.size()),
+                tail_max_term_freq_};
+    }
+
+    // Распаковывает не больше BLOCK_SIZE вхождений блока и возвращает их число
+    size_t DecodeBlock(size_t block_index, uint32_t* ordinals, uint32_t* term_counts) const {
+        if (block_index == blocks_.size()) {
+            copy(tail_ordinals_.begin(), tail_ordinals_.end(), ordinals);
+            copy(tail_term_counts_.begin(), tail_term_counts_.end(), term_counts);
+            return tail_ordinals_.size();
+        }
+        const Block& block = blocks_[block_index];
+        const uint8_t* input = data_.data() + block.offset;
+        ordinals[0] = block.info.first_ordinal;
+        uint64_t bits = 0;
+        uint32_t bit_count = 0;
+        const uint64_t mask = block.bit_width == 32 ? UINT32_MAX : (uint64_t{1} << block.bit_width) - 1;
+        for (size_t i = 1; i < block.info.size; ++i) {
+            while (bit_count < block.bit_width) {
+                bits |= uint64_t{*input++} << bit_count;
+                bit_count += 8;
+            }
+            ordinals[i] = ordinals[i - 1] + 1 + static_cast<uint32_t>(bits & mask);
+            bits >>= block.bit_width;
+            bit_count -= block.bit_width;
+        }
+        for (size_t i = 0; i < block.info.size; ++i) {
+            uint32_t value = 0;
+            for (uint32_t shift = 0;; shift += 7) {
+                const uint8_t byte = *input++;
+                value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            term_counts[i] = value;
+        }
+        return block.info.size;
+    }
+
+    // Вызывает callback(ordinals, term_counts, count) для каждого блока по порядку
+    template <typename Callback>
+    void ForEachBlock(Callback callback) const {
+        uint32_t ordinals[BLOCK_SIZE];
+        uint32_t term_counts[BLOCK_SIZE];
+        for (size_t i = 0; i < GetBlockCount(); ++i) {
+            callback(ordinals, term_counts, DecodeBlock(i, ordinals, term_counts));
+        }
+    }
+
+    // Байты, занятые вхождениями, без учёта запаса ёмкости векторов
+    size_t GetMemoryUsage() const {
+        return data_.size() + blocks_.size() * sizeof(Block)
+            + tail_ordinals_.size() * (sizeof(uint32_t) + sizeof(uint32_t));
+    }
+
+private:
+    struct Block {
+        BlockInfo info;
+        // Начало блока в data_
+        uint32_t offset;
+        uint8_t bit_width;
+    };
+
+    // Разности номеров записываются младшими битами вперёд, затем числа вхождений
+    static Block EncodeBlock(const uint32_t* ordinals, const uint32_t* term_counts, size_t count,
+                             double max_term_freq, vector<uint8_t>& output) {
+        uint32_t max_delta = 0;
+        for (size_t i = 1; i < count; ++i) {
+            max_delta = max(max_delta, ordinals[i] - ordinals[i - 1] - 1);
+        }
+        uint8_t bit_width = 0;
+        while (bit_width < 32 && (max_delta >> bit_width) != 0) {
+            ++bit_width;
+        }
+        const Block block{{ordinals[0], ordinals[count - 1], static_cast<uint32_t>(count), max_term_freq},
+                          static_cast<uint32_t>(output.size()), bit_width};
+        uint64_t bits = 0;
+        uint32_t bit_count = 0;
+        for (size_t i = 1; i < count; ++i) {
+            bits |= static_cast<uint64_t>(ordinals[i] - ordinals[i - 1] - 1) << bit_count;
+            bit_count += bit_width;
+            for (; bit_count >= 8; bit_count -= 8) {
+                output.push_back(static_cast<uint8_t>(bits));
+                bits >>= 8;
+            }
+        }
+        if (bit_count > 0) {
+            output.push_back(static_cast<uint8_t>(bits));
+        }
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t value = term_counts[i];
+            for (; value >= 0x80; value >>= 7) {
+                output.push_back(static_cast<uint8_t>(value | 0x80));
+            }
+            output.push_back(static_cast<uint8_t>(value));
+        }
+        return block;
+    }
+
+    // Сжатый блок, который может содержать номер, или blocks_.size()
+    size_t FindBlock(uint32_t ordinal) const {
+        const auto it = lower_bound(blocks_.begin(), blocks_.end(), ordinal, [](const Block& block, uint32_t ordinal) {
+            return block.info.last_ordinal < ordinal;
+        });
+        return it == blocks_.end() || it->info.first_ordinal > ordinal ? blocks_.size() : it - blocks_.begin();
+    }
+
+    vector<uint8_t> data_;
+    vector<Block> blocks_;
+    vector<uint32_t> tail_ordinals_;
+    vector<uint32_t> tail_term_counts_;
+    double tail_max_term_freq_ = 0.0;
+    size_t size_ = 0;
+};
+
+// Проход по списку вхождений с пропуском блоков по их границам. Номера, к которым
+// переходит курсор, не должны убывать
+class PostingCursor {
+public:
+    static constexpr uint32_t END = numeric_limits<uint32_t>::max();
+
+    explicit PostingCursor(const PostingList& postings)
+        : postings_(&postings)
+        , block_count_(postings.GetBlockCount()) {
+        LoadBlock();
+    }
+
+    // Номер документа текущего вхождения или END после конца списка
+    uint32_t GetOrdinal() const {
+        return ordinal_;
+    }
+
+    uint32_t GetTermCount() const {
+        return term_counts_[position_];
+    }
+
+    void Next() {
+        if (++position_ < block_size_) {
+            ordinal_ = ordinals_[position_];
+        } else {
+            block_index_ = decoded_block_ + 1;
+            LoadBlock();
+        }
+    }
+
+    // Переходит к первому вхождению с номером не меньше target
+    void Seek(uint32_t target) {
+        if (ordinal_ >= target) {
+            return;
+        }
+        ShallowSeek(target);
+        if (block_index_ != decoded_block_) {
+            LoadBlock();
+            if (ordinal_ >= target) {
+                return;
+            }
+        }
+        position_ = lower_bound(ordinals_ + position_, ordinals_ + block_size_, target) - ordinals_;
+        ordinal_ = ordinals_[position_];
+    }
+
+    // Переходит к блоку, который может содержать target, не распаковывая его
+    void ShallowSeek(uint32_t target) {
+        while (block_index_ < block_count_ && postings_->GetBlockInfo(block_index_).last_ordinal < target) {
+            ++block_index_;
+        }
+    }
+
+    // Верхняя граница TF в блоке, к которому перешёл курсор
+    double GetBlockMaxTermFreq() const {
+        return block_index_ < block_count_ ? postings_->GetBlockInfo(block_index_).max_term_freq : 0.0;
+    }
+
+    // Сколько вхождений курсор распаковал с начала прохода
+    size_t GetDecodedCount() const {
+        return decoded_count_;
+    }
+
+private:
+    void LoadBlock() {
+        decoded_block_ = block_index_;
+        position_ = 0;
+        block_size_ = block_index_ < block_count_ ? postings_->DecodeBlock(block_index_, ordinals_, term_counts_) : 0;
+        ordinal_ = block_size_ > 0 ? ordinals_[0] : END;
+        decoded_count_ += block_size_;
+    }
+
+    const PostingList* postings_;
+    size_t block_count_;
+    size_t block_index_ = 0;
+    size_t decoded_block_ = 0;
+    size_t position_ = 0;
+    size_t block_size_ = 0;
+    size_t decoded_count_ = 0;
+    uint32_t ordinal_ = END;
+    uint32_t ordinals_[PostingList::BLOCK_SIZE];
+    uint32_t term_counts_[PostingList::BLOCK_SIZE];
+};
+
+// Позиции слова в документах, где оно встречается: номера слов документа без стоп-слов
+// по возрастанию, записанные varint разностями соседних. Документы идут по возрастанию
+// внутренних номеров, как в PostingList
+class PositionList {
+public:
+    bool IsEmpty() const {
+        return ordinals_.empty();
+    }
+
+    // Номер должен быть больше всех номеров списка
+    void Add(uint32_t ordinal, const vector<uint32_t>& positions) {
+        ordinals_.push_back(ordinal);
+        offsets_.push_back(static_cast<uint32_t>(data_.size()));
+        uint32_t previous = 0;
+        for (const uint32_t position : positions) {
+            uint32_t value = position - previous;
+            for (; value >= 0x80; value >>= 7) {
+                data_.push_back(static_cast<uint8_t>(value | 0x80));
+            }
+            data_.push_back(static_cast<uint8_t>(value));
+            previous = position;
+        }
+    }
+
+    void Erase(uint32_t ordinal) {
+        const auto it = lower_bound(ordinals_.begin(), ordinals_.end(), ordinal);
+        if (it == ordinals_.end() || *it != ordinal) {
+            return;
+        }
+        const size_t index = it - ordinals_.begin();
+        const uint32_t begin = offsets_[index];
+        const uint32_t size = GetEnd(index) - begin;
+        data_.erase(data_.begin() + begin, data_.begin() + begin + size);
+        ordinals_.erase(it);
+        offsets_.erase(offsets_.begin() + index);
+        for (size_t i = index; i < offsets_.size(); ++i) {
+            offsets_[i] -= size;
+        }
+    }
+
+    // Заменяет содержимое positions позициями слова в документе; false, если их нет
+    template <typename PositionContainer>
+    bool Decode(uint32_t ordinal, PositionContainer& positions) const {
+        positions.clear();
+        const auto it = lower_bound(ordinals_.begin(), ordinals_.end(), ordinal);
+        if (it == ordinals_.end() || *it != ordinal) {
+            return false;
+        }
+        const size_t index = it - ordinals_.begin();
+        const uint8_t* input = data_.data() + offsets_[index];
+        const uint8_t* const end = data_.data() + GetEnd(index);
+        uint32_t position = 0;
+        while (input != end) {
+            uint32_t value = 0;
+            for (uint32_t shift = 0;; shift += 7) {
+                const uint8_t byte = *input++;
+                value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            position += value;
+            positions.push_back(position);
+        }
+        return true;
+    }
+
+    // Новые номера должны идти в том же порядке, что и старые
+    void Renumber(const vector<uint32_t>& new_ordinals) {
+        for (uint32_t& ordinal : ordinals_) {
+            ordinal = new_ordinals[ordinal];
+        }
+    }
+
+private:
+    uint32_t GetEnd(size_t index) const {
+        return index + 1 < offsets_.size() ? offsets_[index + 1] : static_cast<uint32_t>(data_.size());
+    }
+
+    vector<uint32_t> ordinals_;
+    // Начало позиций документа в data_
+    vector<uint32_t> offsets_;
+    vector<uint8_t> data_;
+};
+
+// Память для временных данных запроса. Буфер свой у каждого потока и переживает запросы:
+// выделение - сдвиг указателя, освобождение - сброс всего буфера после запроса. Если
+// запросу не хватило буфера, недостающее берётся из общей кучи, а при сбросе буфер
+// вырастает до пикового размера, поэтому повторяющиеся запросы кучу не трогают
+class QueryArena {
+public:
+    static constexpr size_t INITIAL_CAPACITY = 64 * 1024;
+
+    // Область одного запроса. Вложенные области, например поиск из предиката или задачи,
+    // которую поток взял, ожидая параллельный алгоритм, пишут в ту же память и не сбрасывают её
+    class Scope {
+    public:
+        Scope()
+            : arena_(GetThreadArena()) {
+            ++arena_.depth_;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            if (--arena_.depth_ == 0) {
+                arena_.Reset();
+            }
+        }
+
+        pmr::memory_resource* GetResource() const {
+            return &*arena_.resource_;
+        }
+
+    private:
+        QueryArena& arena_;
+    };
+
+    static QueryArena& GetThreadArena() {
+        thread_local QueryArena arena;
+        return arena;
+    }
+
+    size_t GetCapacity() const {
+        return buffer_.size();
+    }
+
+    // Сколько раз арене не хватило буфера и память бралась из кучи
+    uint64_t GetHeapAllocationCount() const {
+        return upstream_.allocation_count;
+    }
+
+private:
+    // Куча, которая запоминает, сколько памяти у неё взяли сверх буфера
+    class CountingResource : public pmr::memory_resource {
+    public:
+        size_t allocated_bytes = 0;
+        uint64_t allocation_count = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            allocated_bytes += bytes;
+            ++allocation_count;
+            return pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
+
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    QueryArena()
+        : buffer_(INITIAL_CAPACITY) {
+        resource_.emplace(buffer_.data(), buffer_.size(), &upstream_);
+    }
+
+    void Reset() {
+        if (upstream_.allocated_bytes == 0) {
+            resource_->release();
+            return;
+        }
+        const size_t capacity = buffer_.size() + upstream_.allocated_bytes;
+        resource_.reset();
+        upstream_.allocated_bytes = 0;
+        buffer_.assign(capacity, 0);
+        resource_.emplace(buffer_.data(), buffer_.size(), &upstream_);
+    }
+
+    CountingResource upstream_;
+    vector<char> buffer_;
+    optional<pmr::monotonic_buffer_resource> resource_;
+    size_t depth_ = 0;
+};
+
+// Этапы, время которых собирает SearchMetrics. Разбор запроса включает его разбиение на слова
+enum class SearchStage {
+    TOKENIZE,
+    PARSE_QUERY,
+    SCORE,
+    EXCLUDE_MINUS_WORDS,
+    SORT_TOP,
+};
+
+inline constexpr size_t SEARCH_STAGE_COUNT = 5;
+
+// Что сделал один поиск FindTopDocuments
+struct QueryTrace {
+    size_t plus_word_count = 0;
+    size_t minus_word_count = 0;
+    // Распакованные вхождения плюс- и минус-слов
+    size_t postings_scanned = 0;
+    // Документы, прошедшие фильтр, до отбора лучших
+    size_t documents_matched = 0;
+    size_t documents_returned = 0;
+    bool is_pruned = false;
+    // Поиск остановлен по сроку или отмене, результат неполный
+    bool is_interrupted = false;
+};
+
+// Счётчики и гистограммы длительности этапов поиска. Потоки пишут в разные полосы
+// атомарных счётчиков без блокировок, снимок складывает полосы. Снимок во время
+// записи не атомарен как целое: счётчики одного этапа могут разойтись на один вызов
+class SearchMetrics {
+public:
+    // Корзина i - длительности [2^i, 2^(i+1)) нс, последняя корзина собирает всё, что дольше
+    static constexpr size_t HISTOGRAM_BUCKET_COUNT = 32;
+
+    struct StageStatistics {
+        uint64_t call_count = 0;
+        uint64_t total_nanoseconds = 0;
+        array<uint64_t, HISTOGRAM_BUCKET_COUNT> histogram{};
+    };
+
+    struct Snapshot {
+        array<StageStatistics, SEARCH_STAGE_COUNT> stages{};
+        uint64_t query_count = 0;
+        uint64_t postings_scanned = 0;
+        uint64_t documents_matched = 0;
+        uint64_t pruned_query_count = 0;
+
+        const StageStatistics& GetStage(SearchStage stage) const {
+            return stages[static_cast<size_t>(stage)];
+        }
+    };
+
+    void RecordStage(SearchStage stage, chrono::nanoseconds duration) {
+        const uint64_t nanoseconds = static_cast<uint64_t>(max<chrono::nanoseconds::rep>(duration.count(), 0));
+        size_t bucket = 0;
+        for (uint64_t rest = nanoseconds >> 1; rest > 0 && bucket + 1 < HISTOGRAM_BUCKET_COUNT; rest >>= 1) {
+            ++bucket;
+        }
+        StageCounters& counters = GetStripe().stages[static_cast<size_t>(stage)];
+        counters.call_count.fetch_add(1, memory_order_relaxed);
+        counters.total_nanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+        counters.histogram[bucket].fetch_add(1, memory_order_relaxed);
+    }
+
+    void RecordQuery(const QueryTrace& trace) {
+        Stripe& stripe = GetStripe();
+        stripe.query_count.fetch_add(1, memory_order_relaxed);
+        stripe.postings_scanned.fetch_add(trace.postings_scanned, memory_order_relaxed);
+        stripe.documents_matched.fetch_add(trace.documents_matched, memory_order_relaxed);
+        stripe.pruned_query_count.fetch_add(trace.is_pruned, memory_order_relaxed);
+    }
+
+    Snapshot GetSnapshot() const {
+        Snapshot snapshot;
+        for (const Stripe& stripe : stripes_) {
+            for (size_t stage = 0; stage < SEARCH_STAGE_COUNT; ++stage) {
+                const StageCounters& counters = stripe.stages[stage];
+                StageStatistics& statistics = snapshot.stages[stage];
+                statistics.call_count += counters.call_count.load(memory_order_relaxed);
+                statistics.total_nanoseconds += counters.total_nanoseconds.load(memory_order_relaxed);
+                for (size_t bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+                    statistics.histogram[bucket] += counters.histogram[bucket].load(memory_order_relaxed);
+                }
+            }
+            snapshot.query_count += stripe.query_count.load(memory_order_relaxed);
+            snapshot.postings_scanned += stripe.postings_scanned.load(memory_order_relaxed);
+            snapshot.documents_matched += stripe.documents_matched.load(memory_order_relaxed);
+            snapshot.pruned_query_count += stripe.pruned_query_count.load(memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+    void Reset() {
+        for (Stripe& stripe : stripes_) {
+            for (StageCounters& counters : stripe.stages) {
+                counters.call_count.store(0, memory_order_relaxed);
+                counters.total_nanoseconds.store(0, memory_order_relaxed);
+                for (atomic<uint64_t>& bucket : counters.histogram) {
+                    bucket.store(0, memory_order_relaxed);
+                }
+            }
+            stripe.query_count.store(0, memory_order_relaxed);
+            stripe.postings_scanned.store(0, memory_order_relaxed);
+            stripe.documents_matched.store(0, memory_order_relaxed);
+            stripe.pruned_query_count.store(0, memory_order_relaxed);
+        }
+    }
+
+    static string_view GetStageName(SearchStage stage) {
+        static constexpr string_view names[SEARCH_STAGE_COUNT] = {
+            "tokenize"sv, "parse_query"sv, "score"sv, "exclude_minus_words"sv, "sort_top"sv};
+        return names[static_cast<size_t>(stage)];
+    }
+
+    // Текстовый формат для сборщика метрик: одна строка "имя{метки} значение" на счётчик,
+    // корзины гистограммы накопительные, как принято в Prometheus
+    void WriteText(ostream& out) const {
+        const Snapshot snapshot = GetSnapshot();
+        for (size_t stage = 0; stage < SEARCH_STAGE_COUNT; ++stage) {
+            const string_view name = GetStageName(static_cast<SearchStage>(stage));
+            const StageStatistics& statistics = snapshot.stages[stage];
+            uint64_t cumulative_count = 0;
+            for (size_t bucket = 0; bucket + 1 < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+                cumulative_count += statistics.histogram[bucket];
+                out << "search_stage_duration_ns_bucket{stage=\""s << name << "\",le=\""s
+                    << ((uint64_t{2} << bucket) - 1) << "\"} "s << cumulative_count << '\n';
+            }
+            out << "search_stage_duration_ns_bucket{stage=\""s << name << "\",le=\"+Inf\"} "s
+                << statistics.call_count << '\n';
+            out << "search_stage_duration_ns_sum{stage=\""s << name << "\"} "s << statistics.total_nanoseconds << '\n';
+            out << "search_stage_duration_ns_count{stage=\""s << name << "\"} "s << statistics.call_count << '\n';
+        }
+        out << "search_queries_total "s << snapshot.query_count << '\n';
+        out << "search_pruned_queries_total "s << snapshot.pruned_query_count << '\n';
+        out << "search_postings_scanned_total "s << snapshot.postings_scanned << '\n';
+        out << "search_documents_matched_total "s << snapshot.documents_matched << '\n';
+    }
+
+private:
+    static constexpr size_t STRIPE_COUNT = 16;
+
+    struct StageCounters {
+        atomic<uint64_t> call_count{0};
+        atomic<uint64_t> total_nanoseconds{0};
+        array<atomic<uint64_t>, HISTOGRAM_BUCKET_COUNT> histogram{};
+    };
+
+    // Полоса занимает свои строки кеша, чтобы потоки не делили их между собой
+    struct alignas(64) Stripe {
+        array<StageCounters, SEARCH_STAGE_COUNT> stages;
+        atomic<uint64_t> query_count{0};
+        atomic<uint64_t> postings_scanned{0};
+        atomic<uint64_t> documents_matched{0};
+        atomic<uint64_t> pruned_query_count{0};
+    };
+
+    Stripe& GetStripe() {
+        thread_local const size_t stripe_index = hash<thread::id>{}(this_thread::get_id()) % STRIPE_COUNT;
+        return stripes_[stripe_index];
+    }
+
+    array<Stripe, STRIPE_COUNT> stripes_;
+};
+
+// Замер этапа поиска от создания до разрушения; без метрик часы не читаются
+class SearchStageTimer {
+public:
+    SearchStageTimer(SearchMetrics* metrics, SearchStage stage)
+        : metrics_(metrics)
+        , stage_(stage) {
+        if (metrics_ != nullptr) {
+            start_time_ = chrono::steady_clock::now();
+        }
+    }
+
+    SearchStageTimer(const SearchStageTimer&) = delete;
+    SearchStageTimer& operator=(const SearchStageTimer&) = delete;
+
+    ~SearchStageTimer() {
+        if (metrics_ != nullptr) {
+            metrics_->RecordStage(stage_, chrono::steady_clock::now() - start_time_);
+        }
+    }
+
+private:
+    SearchMetrics* metrics_;
+    SearchStage stage_;
+    chrono::steady_clock::time_point start_time_;
+};
+
+// Флаг отмены асинхронного запроса. Копии разделяют один флаг, поэтому копию можно
+// отдать запросу, а отменять через оригинал
+class CancellationToken {
+public:
+    CancellationToken()
+        : is_cancelled_(make_shared<atomic<bool>>(false)) {
+    }
+
+    void Cancel() const {
+        is_cancelled_->store(true, memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return is_cancelled_->load(memory_order_relaxed);
+    }
+
+private:
+    shared_ptr<atomic<bool>> is_cancelled_;
+};
+
+// Пул потоков с очередью задач у каждого потока. Поток берёт задачи из конца своей
+// очереди, а когда она пуста - крадёт из начала чужих. Задачи, поставленные из потока
+// пула, идут в его очередь, остальные раскладываются по очередям по кругу.
+// Деструктор выполняет оставшиеся задачи и дожидается потоков
+class QueryExecutor {
+public:
+    explicit QueryExecutor(size_t thread_count = max(1u, thread::hardware_concurrency()))
+        : queues_(max<size_t>(thread_count, 1)) {
+        threads_.reserve(queues_.size());
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            threads_.emplace_back([this, i] {
+                RunWorker(i);
+            });
+        }
+    }
+
+    QueryExecutor(const QueryExecutor&) = delete;
+    QueryExecutor& operator=(const QueryExecutor&) = delete;
+
+    ~QueryExecutor() {
+        {
+            lock_guard guard(wake_mutex_);
+            is_stopping_ = true;
+        }
+        wake_.notify_all();
+        for (thread& worker : threads_) {
+            worker.join();
+        }
+    }
+
+    // Исключение задачи передаётся через future
+    template <typename Function>
+    future<invoke_result_t<Function>> Submit(Function function) {
+        auto task = make_shared<packaged_task<invoke_result_t<Function>()>>(move(function));
+        future<invoke_result_t<Function>> result = task->get_future();
+        const WorkerIndex& current = GetCurrentWorker();
+        const size_t queue_index = current.executor == this
+            ? current.index : next_queue_.fetch_add(1, memory_order_relaxed) % queues_.size();
+        // Сначала счётчик, затем очередь: иначе поток может взять задачу и уменьшить
+        // счётчик до того, как он увеличен
+        {
+            lock_guard guard(wake_mutex_);
+            ++pending_count_;
+        }
+        {
+            lock_guard guard(queues_[queue_index].tasks_mutex);
+            queues_[queue_index].tasks.emplace_back([task] {
+                (*task)();
+            });
+        }
+        wake_.notify_one();
+        return result;
+    }
+
+    size_t GetThreadCount() const {
+        return threads_.size();
+    }
+
+    // Общий пул процесса с потоком на каждое ядро
+    static QueryExecutor& GetDefault() {
+        static QueryExecutor executor;
+        return executor;
+    }
+
+private:
+    struct TaskQueue {
+        mutex tasks_mutex;
+        deque<function<void()>> tasks;
+    };
+
+    struct WorkerIndex {
+        const QueryExecutor* executor = nullptr;
+        size_t index = 0;
+    };
+
+    static WorkerIndex& GetCurrentWorker() {
+        thread_local WorkerIndex worker;
+        return worker;
+    }
+
+    void RunWorker(size_t index) {
+        GetCurrentWorker() = {this, index};
+        while (true) {
+            function<void()> task;
+            if (TryTakeTask(index, task)) {
+                {
+                    lock_guard guard(wake_mutex_);
+                    --pending_count_;
+                }
+                task();
+                continue;
+            }
+            unique_lock lock(wake_mutex_);
+            wake_.wait(lock, [this] {
+                return pending_count_ > 0 || is_stopping_;
+            });
+            if (pending_count_ == 0) {
+                return;
+            }
+        }
+    }
+
+    bool TryTakeTask(size_t index, function<void()>& task) {
+        {
+            TaskQueue& own = queues_[index];
+            lock_guard guard(own.tasks_mutex);
+            if (!own.tasks.empty()) {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues_.size(); ++offset) {
+            TaskQueue& other = queues_[(index + offset) % queues_.size()];
+            lock_guard guard(other.tasks_mutex);
+            if (!other.tasks.empty()) {
+                task = move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    deque<TaskQueue> queues_;
+    vector<thread> threads_;
+    atomic<size_t> next_queue_{0};
+    mutex wake_mutex_;
+    condition_variable wake_;
+    // Поставленные и ещё не взятые задачи
+    size_t pending_count_ = 0;
+    bool is_stopping_ = false;
+};
+
+// Параметры асинхронного поиска. По истечении срока или после отмены поиск
+// прекращает подсчёт релевантности и возвращает документы, найденные к этому моменту
+struct AsyncSearchOptions {
+    DocumentStatus status = DocumentStatus::ACTUAL;
+    size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    CancellationToken cancellation;
+};
+
+struct AsyncSearchResult {
+    vector<Document> documents;
+    // false, если поиск остановлен по сроку или отмене
+    bool is_complete = true;
+};
+
+// Формат снимка индекса. Все секции выровнены по 8 байт, числа в порядке байт машины,
+// записавшей файл. Документы отсортированы по id, слова - по тексту, вхождения
+// каждого слова лежат подряд и ссылаются на номер документа в секции документов
+inline constexpr char SNAPSHOT_MAGIC[8] = {'S', 'R', 'C', 'H', 'I', 'D', 'X', '\0'};
+inline constexpr uint32_t SNAPSHOT_VERSION = 1;
+inline constexpr uint32_t SNAPSHOT_BYTE_ORDER_MARK = 0x01020304;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint64_t document_count;
+    uint64_t word_count;
+    uint64_t posting_count;
+    uint64_t stop_word_count;
+    uint64_t documents_offset;
+    uint64_t document_order_offset;
+    uint64_t words_offset;
+    uint64_t postings_offset;
+    uint64_t stop_words_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    double log_document_count;
+};
+
+struct SnapshotString {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SnapshotDocument {
+    int32_t id;
+    int32_t rating;
+    int32_t status;
+    uint32_t reserved;
+};
+
+struct SnapshotWord {
+    SnapshotString text;
+    uint64_t first_posting;
+    uint64_t posting_count;
+    double log_document_freq;
+};
+
+struct SnapshotPosting {
+    uint32_t document_index;
+    uint32_t reserved;
+    double term_freq;
+};
+
+class SearchServer {
+public:
+    
+    inline static constexpr int INVALID_DOCUMENT_ID = -1;
+
+    using Query = ::Query;
+
+    SearchServer() = default;
+    
+    template <typename StringContainer>
+    explicit SearchServer(const StringContainer& stop_words) {
+        for (const auto& word : stop_words) {
+            if (!IsValidWord(word)) {
+                throw invalid_argument("Стоп слова не должны содержать недопустимые символы"); 
+            }
+        }
+        stop_words_ = StopWordSet(stop_words);
+    }
+
+    explicit SearchServer(string_view stop_words_text)
+        : SearchServer(CheckStopWordsText(stop_words_text)) {
+    }
+
+    explicit SearchServer(const string& stop_words_text)
+        : SearchServer(string_view(stop_words_text)) {
+    }
+
+    // Ключи словаря и прямого индекса ссылаются на words_storage_ этого же объекта,
+    // поэтому при копировании слова заново копируются в своё хранилище. Слова без
+    // вхождений при этом отбрасываются. Перемещение обходится без этого: deque при
+    // перемещении не перемещает свои элементы
+    SearchServer(const SearchServer& other)
+        : stop_words_(other.stop_words_)
+        , log_document_count_(other.log_document_count_)
+        , document_list_(other.document_list_)
+        , document_ordinals_(other.document_ordinals_)
+        , ordinal_to_id_(other.ordinal_to_id_)
+        , document_ratings_(other.document_ratings_)
+        , document_statuses_(other.document_statuses_)
+        , document_lengths_(other.document_lengths_)
+        , document_word_freqs_(other.document_word_freqs_.size())
+        , status_masks_(other.status_masks_)
+        , generation_(other.generation_)
+        , metrics_(other.metrics_)
+        , executor_(other.executor_)
+        , has_positions_(other.has_positions_) {
+        word_index_.reserve(other.word_index_.size());
+        for (const auto& [word, entry] : other.word_index_) {
+            if (!entry.postings.IsEmpty()) {
+                const string& stored_word = words_storage_.emplace_back(word);
+                word_index_.emplace(stored_word, entry);
+            }
+        }
+        for (size_t ordinal = 0; ordinal < other.document_word_freqs_.size(); ++ordinal) {
+            map<string_view, double>& word_freqs = document_word_freqs_[ordinal];
+            for (const auto& [word, term_freq] : other.document_word_freqs_[ordinal]) {
+                word_freqs.emplace_hint(word_freqs.end(), word_index_.find(word)->first, term_freq);
+            }
+        }
+    }
+
+    SearchServer& operator=(const SearchServer& other) {
+        if (this != &other) {
+            *this = SearchServer(other);
+        }
+        return *this;
+    }
+
+    SearchServer(SearchServer&&) = default;
+    SearchServer& operator=(SearchServer&&) = default;
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        // Проверка на отрицательный id и на существующий id
+        if (document_id < 0 || document_ordinals_.count(document_id)) {
+            throw invalid_argument("Нельзя добавлять документы с отрицательным id или уже существуюищим id");
+        }
+        
+        const ParsedDocument parsed = ParseDocument(document);
+        if (!parsed.is_valid) {
+            throw invalid_argument("Нельзя использовать недопустимые символы в документах");
+        }
+        const uint32_t ordinal = AllocateOrdinal(document_id, ComputeAverageRating(ratings), status, parsed.word_count);
+        // Прямой индекс хранит ссылки на слова индекса, а не на текст документа
+        map<string_view, double> indexed_word_freqs;
+        for (const auto& [word, term_count] : parsed.term_counts) {
+            auto& [indexed_word, entry] = GetOrCreateWordEntry(word);
+            const double term_freq = ComputeTermFreq(term_count, ordinal);
+            entry.postings.Add(ordinal, term_count, term_freq);
+            if (has_positions_) {
+                entry.positions.Add(ordinal, parsed.word_positions.at(word));
+            }
+            UpdateWordStatistics(entry);
+            indexed_word_freqs.emplace_hint(indexed_word_freqs.end(), indexed_word, term_freq);
+        }
+        document_word_freqs_[ordinal] = move(indexed_word_freqs);
+        document_list_.push_back(document_id); // Храним порядок id
+        UpdateDocumentCountStatistics();
+        generation_ = AllocateGeneration();
+    }
+
+    template <typename DocumentRange>
+    void AddDocuments(const DocumentRange& documents) {
+        AddDocuments(execution::seq, documents);
+    }
+
+    // Пакетное добавление диапазона RawDocument. Разбор документов и построение
+    // частичных списков вхождений идут параллельно, затем частичные списки
+    // дописываются в индекс. Внутренние номера выдаются в порядке id. Пакет добавляется целиком или не добавляется
+    // вовсе: те же ошибки, что и у AddDocument, проверяются до изменения индекса
+    template <typename ExecutionPolicy, typename DocumentRange>
+    void AddDocuments(ExecutionPolicy&& policy, const DocumentRange& documents) {
+        vector<const RawDocument*> batch;
+        for (const RawDocument& document : documents) {
+            batch.push_back(&document);
+        }
+        if (batch.empty()) {
+            return;
+        }
+        vector<const RawDocument*> sorted_batch = batch;
+        sort(sorted_batch.begin(), sorted_batch.end(), [](const RawDocument* lhs, const RawDocument* rhs) {
+            return lhs->id < rhs->id;
+        });
+        for (size_t i = 0; i < sorted_batch.size(); ++i) {
+            const int document_id = sorted_batch[i]->id;
+            if (document_id < 0 || document_ordinals_.count(document_id)
+                || (i > 0 && sorted_batch[i - 1]->id == document_id)) {
+                throw invalid_argument("Нельзя добавлять документы с отрицательным id или уже существуюищим id");
+            }
+        }
+
+        // Исключение внутри параллельного алгоритма завершило бы программу,
+        // поэтому ошибки разбора собираются и проверяются после него
+        vector<ParsedDocument> parsed(sorted_batch.size());
+        transform(policy, sorted_batch.begin(), sorted_batch.end(), parsed.begin(), [this](const RawDocument* document) {
+            return ParseDocument(document->text);
+        });
+        if (!all_of(parsed.begin(), parsed.end(), [](const ParsedDocument& document) {
+            return document.is_valid;
+        })) {
+            throw invalid_argument("Нельзя использовать недопустимые символы в документах");
+        }
+
+        const uint32_t first_ordinal = static_cast<uint32_t>(ordinal_to_id_.size());
+        for (size_t i = 0; i < sorted_batch.size(); ++i) {
+            AllocateOrdinal(sorted_batch[i]->id, ComputeAverageRating(sorted_batch[i]->ratings), sorted_batch[i]->status,
+                            parsed[i].word_count);
+        }
+
+        // Частичные списки вхождений: каждая часть пакета строит свои независимо.
+        // Элемент списка - внутренний номер документа и число вхождений слова в него
+        const size_t part_count = is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>
+            ? 1 : min<size_t>(max(1u, thread::hardware_concurrency()), parsed.size());
+        vector<unordered_map<string_view, vector<pair<uint32_t, uint32_t>>>> part_postings(part_count);
+        vector<size_t> parts(part_count);
+        iota(parts.begin(), parts.end(), 0);
+        for_each(policy, parts.begin(), parts.end(), [&](size_t part) {
+            const size_t begin = parsed.size() * part / part_count;
+            const size_t end = parsed.size() * (part + 1) / part_count;
+            for (size_t i = begin; i < end; ++i) {
+                for (const auto& [word, term_count] : parsed[i].term_counts) {
+                    part_postings[part][word].emplace_back(first_ordinal + static_cast<uint32_t>(i), term_count);
+                }
+            }
+        });
+
+        // Номера пакета больше всех прежних, а части идут по возрастанию номеров,
+        // поэтому вхождения дописываются в конец без слияния
+        vector<WordEntry*> touched_entries;
+        for (auto& postings_by_word : part_postings) {
+            for (auto& [word, postings] : postings_by_word) {
+                WordEntry& entry = GetOrCreateWordEntry(word).second;
+                for (const auto& [ordinal, term_count] : postings) {
+                    entry.postings.Add(ordinal, term_count, ComputeTermFreq(term_count, ordinal));
+                    if (has_positions_) {
+                        entry.positions.Add(ordinal, parsed[ordinal - first_ordinal].word_positions.at(word));
+                    }
+                }
+                touched_entries.push_back(&entry);
+            }
+        }
+
+        // Словарь больше не меняется, и прямой индекс можно строить параллельно
+        vector<map<string_view, double>> indexed_word_freqs(parsed.size());
+        transform(policy, parsed.begin(), parsed.end(), indexed_word_freqs.begin(), [this](const ParsedDocument& document) {
+            map<string_view, double> result;
+            for (const auto& [word, term_count] : document.term_counts) {
+                result.emplace_hint(result.end(), word_index_.find(word)->first,
+                                    static_cast<double>(term_count) / document.word_count);
+            }
+            return result;
+        });
+        move(indexed_word_freqs.begin(), indexed_word_freqs.end(), document_word_freqs_.begin() + first_ordinal);
+        for (const RawDocument* document : batch) {
+            document_list_.push_back(document->id);
+        }
+
+        // Статистика для IDF пересчитывается один раз на пакет
+        sort(touched_entries.begin(), touched_entries.end());
+        touched_entries.erase(unique(touched_entries.begin(), touched_entries.end()), touched_entries.end());
+        for_each(policy, touched_entries.begin(), touched_entries.end(), [](WordEntry* entry) {
+            UpdateWordStatistics(*entry);
+        });
+        UpdateDocumentCountStatistics();
+        generation_ = AllocateGeneration();
+    }
+
+    void RemoveDocument(int document_id) {
+        RemoveDocument(execution::seq, document_id);
+    }
+
+    // Удаление затрагивает только списки вхождений слов самого документа.
+    // Несуществующий id игнорируется
+    template <typename ExecutionPolicy>
+    void RemoveDocument(ExecutionPolicy&& policy, int document_id) {
+        const auto document_it = document_ordinals_.find(document_id);
+        if (document_it == document_ordinals_.end()) {
+            return;
+        }
+        const uint32_t ordinal = document_it->second;
+        map<string_view, double>& word_freqs = document_word_freqs_[ordinal];
+        // Слова документа различны, поэтому каждый поток меняет свой список вхождений
+        for_each(policy, word_freqs.begin(), word_freqs.end(), [this, ordinal](const auto& word_freq) {
+            WordEntry& entry = word_index_.at(word_freq.first);
+            entry.postings.Erase(ordinal);
+            entry.positions.Erase(ordinal);
+            UpdateWordStatistics(entry);
+        });
+        // Номер удалённого документа больше не выдаётся, его ячейки в массивах остаются пустыми
+        status_masks_[static_cast<size_t>(document_statuses_[ordinal])].Reset(ordinal);
+        ordinal_to_id_[ordinal] = INVALID_DOCUMENT_ID;
+        word_freqs.clear();
+        document_ordinals_.erase(document_it);
+        document_list_.erase(find(document_list_.begin(), document_list_.end(), document_id));
+        const size_t removed_count = ordinal_to_id_.size() - document_ordinals_.size();
+        if (removed_count >= COMPACTION_MIN_REMOVED && removed_count * 2 > ordinal_to_id_.size()) {
+            CompactOrdinals();
+        }
+        UpdateDocumentCountStatistics();
+        generation_ = AllocateGeneration();
+    }
+
+    // Переносит документы other, для которых keep(document_id) истинно, вместе с их словами.
+    // Текст не нужен: вхождения берутся из списков other, поэтому TF и IDF получаются
+    // такими же, как при добавлении исходных текстов. Стоп-слова у серверов должны совпадать,
+    // и если этот сервер хранит позиции, их должен хранить и other.
+    // Документы добавляются в порядке id; если какой-то id уже есть, сервер не меняется
+    template <typename DocumentFilter>
+    void AddDocumentsFrom(const SearchServer& other, DocumentFilter keep) {
+        if (has_positions_ && !other.has_positions_) {
+            throw invalid_argument("Нельзя переносить документы без позиций слов в сервер с позициями");
+        }
+        vector<uint32_t> other_ordinals;
+        for (const auto& [document_id, other_ordinal] : other.document_ordinals_) {
+            if (keep(document_id)) {
+                if (document_ordinals_.count(document_id)) {
+                    throw invalid_argument("Нельзя добавлять документы с отрицательным id или уже существуюищим id");
+                }
+                other_ordinals.push_back(other_ordinal);
+            }
+        }
+        if (other_ordinals.empty()) {
+            return;
+        }
+        constexpr uint32_t NOT_TRANSFERRED = numeric_limits<uint32_t>::max();
+        vector<uint32_t> ordinals(other.ordinal_to_id_.size(), NOT_TRANSFERRED);
+        for (const uint32_t other_ordinal : other_ordinals) {
+            const int document_id = other.ordinal_to_id_[other_ordinal];
+            ordinals[other_ordinal] = AllocateOrdinal(document_id, other.document_ratings_[other_ordinal],
+                                                      other.document_statuses_[other_ordinal],
+                                                      other.document_lengths_[other_ordinal]);
+            document_list_.push_back(document_id);
+        }
+
+        // Номера в other идут в порядке добавления, а здесь - в порядке id, поэтому
+        // вхождения каждого слова сортируются перед дописыванием
+        // Вхождение - новый номер, число вхождений и номер в other
+        vector<tuple<uint32_t, uint32_t, uint32_t>> postings;
+        vector<uint32_t> positions;
+        for (const auto& [word, other_entry] : other.word_index_) {
+            postings.clear();
+            other_entry.postings.ForEachBlock([&](const uint32_t* other_postings, const uint32_t* term_counts, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    if (ordinals[other_postings[i]] != NOT_TRANSFERRED) {
+                        postings.emplace_back(ordinals[other_postings[i]], term_counts[i], other_postings[i]);
+                    }
+                }
+            });
+            if (postings.empty()) {
+                continue;
+            }
+            sort(postings.begin(), postings.end());
+            auto& [indexed_word, entry] = GetOrCreateWordEntry(word);
+            for (const auto& [ordinal, term_count, other_ordinal] : postings) {
+                const double term_freq = ComputeTermFreq(term_count, ordinal);
+                entry.postings.Add(ordinal, term_count, term_freq);
+                if (has_positions_) {
+                    other_entry.positions.Decode(other_ordinal, positions);
+                    entry.positions.Add(ordinal, positions);
+                }
+                document_word_freqs_[ordinal].emplace(indexed_word, term_freq);
+            }
+            UpdateWordStatistics(entry);
+        }
+        UpdateDocumentCountStatistics();
+        generation_ = AllocateGeneration();
+    }
+
+    bool HasDocument(int document_id) const {
+        return document_ordinals_.count(document_id) > 0;
+    }
+
+    // Частоты слов документа; для несуществующего id - пустой словарь
+    const map<string_view, double>& GetWordFrequencies(int document_id) const {
+        static const map<string_view, double> empty_word_freqs;
+        const auto it = document_ordinals_.find(document_id);
+        return it == document_ordinals_.end() ? empty_word_freqs : document_word_freqs_[it->second];
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentPredicate document_predicate,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, ParseQuery(raw_query), document_predicate, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, ParseQuery(raw_query), status, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query) const {
+        return FindTopDocuments(execution::seq, ParseQuery(raw_query));
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(policy, ParseQuery(raw_query), document_predicate, max_result_count);
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query, DocumentStatus status,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(policy, ParseQuery(raw_query), status, max_result_count);
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query) const {
+        return FindTopDocuments(policy, ParseQuery(raw_query));
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(const Query& query, DocumentPredicate document_predicate,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, query, document_predicate, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(const Query& query, DocumentStatus status,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, query, status, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(const Query& query) const {
+        return FindTopDocuments(execution::seq, query);
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const Query& query,
+                                      DocumentPredicate document_predicate,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        const QueryArena::Scope arena_scope;
+        auto candidates = FindTopCandidates(policy, query, MakePredicateFilter(document_predicate),
+                                            MakeLocalInverseDocumentFreq(), max_result_count, arena_scope.GetResource());
+        return SelectTopDocuments(policy, candidates, max_result_count);
+    }
+
+    // Фильтр по статусу проверяет бит в заранее построенной карте вместо вызова
+    // предиката и поиска документа для каждого вхождения
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const Query& query, DocumentStatus status,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(policy, query, GetStatusMask(status), max_result_count);
+    }
+
+    // То же, что FindTopDocuments(raw_query, status, max_result_count), но документы пишутся
+    // в output, минуя промежуточный вектор. Возвращает итератор за последним документом
+    template <typename OutputIterator>
+    OutputIterator WriteTopDocuments(string_view raw_query, DocumentStatus status, size_t max_result_count,
+                                     OutputIterator output) const {
+        const DocumentMask& status_mask = GetStatusMask(status);
+        const QueryArena::Scope arena_scope;
+        auto candidates = FindTopCandidates(execution::seq, ParseQuery(raw_query), [&status_mask](uint32_t ordinal) {
+            return status_mask.Test(ordinal);
+        }, MakeLocalInverseDocumentFreq(), max_result_count, arena_scope.GetResource());
+        KeepTopCandidates(execution::seq, candidates, max_result_count);
+        return move(candidates.begin(), candidates.end(), output);
+    }
+
+    // Поиск среди документов карты, например GetStatusMask(s) & MakeRatingMask(a, b).
+    // Карта действительна, пока сервер не изменился
+    vector<Document> FindTopDocuments(string_view raw_query, const DocumentMask& document_mask,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, ParseQuery(raw_query), document_mask, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(const Query& query, const DocumentMask& document_mask,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(execution::seq, query, document_mask, max_result_count);
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const Query& query, const DocumentMask& document_mask,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        const QueryArena::Scope arena_scope;
+        auto candidates = FindTopCandidates(policy, query, [&document_mask](uint32_t ordinal) {
+            return document_mask.Test(ordinal);
+        }, MakeLocalInverseDocumentFreq(), max_result_count, arena_scope.GetResource());
+        return SelectTopDocuments(policy, candidates, max_result_count);
+    }
+
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, const Query& query) const {
+        return FindTopDocuments(policy, query, DocumentStatus::ACTUAL);
+    }
+
+    // Поиск с IDF, посчитанным снаружи, в порядке query.plus_words. Нужен, когда корпус
+    // разбит на несколько серверов: каждый ранжирует свои документы по общей статистике,
+    // и результаты совпадают с поиском по одному серверу со всем корпусом
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocumentsWithIdf(ExecutionPolicy&& policy, const Query& query,
+                                             const vector<double>& plus_word_idfs, DocumentPredicate document_predicate,
+                                             size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        if (plus_word_idfs.size() != query.plus_words.size()) {
+            throw invalid_argument("Число значений IDF должно совпадать с числом плюс-слов запроса");
+        }
+        const auto inverse_document_freq = [&query, &plus_word_idfs](string_view word, const WordEntry&) {
+            const auto it = lower_bound(query.plus_words.begin(), query.plus_words.end(), word);
+            return plus_word_idfs[it - query.plus_words.begin()];
+        };
+        const QueryArena::Scope arena_scope;
+        auto candidates = FindTopCandidates(policy, query, MakePredicateFilter(document_predicate),
+                                            inverse_document_freq, max_result_count, arena_scope.GetResource());
+        return SelectTopDocuments(policy, candidates, max_result_count);
+    }
+
+    int GetDocumentCount() const {
+        return document_ordinals_.size();
+    }
+
+    // Номер состояния индекса. Меняется при каждом добавлении и удалении документов и
+    // не повторяется ни у одного сервера процесса; у копии он тот же, что у оригинала
+    uint64_t GetGeneration() const {
+        return generation_;
+    }
+
+    // Поиск в потоке исполнителя сервера, по умолчанию - общего пула процесса. Срок и
+    // отмена проверяются между блоками вхождений; отменённый до начала запрос не выполняется.
+    // Сервер должен жить, пока результат не готов, и не меняться во время поиска
+    future<AsyncSearchResult> FindTopDocumentsAsync(string raw_query, AsyncSearchOptions options = {}) const {
+        QueryExecutor& executor = executor_ != nullptr ? *executor_ : QueryExecutor::GetDefault();
+        return executor.Submit([this, raw_query = move(raw_query), options = move(options)] {
+            AsyncSearchResult result;
+            if (options.cancellation.IsCancelled()) {
+                result.is_complete = false;
+                return result;
+            }
+            const SearchLimitsScope limits_scope(options.deadline, options.cancellation);
+            result.documents = FindTopDocuments(execution::seq, raw_query, options.status, options.max_result_count);
+            result.is_complete = !GetThreadQueryTrace().is_interrupted;
+            return result;
+        });
+    }
+
+    // Свой исполнитель для FindTopDocumentsAsync; копии сервера используют тот же
+    void SetExecutor(shared_ptr<QueryExecutor> executor) {
+        executor_ = move(executor);
+    }
+
+    // Включает хранение позиций слов, нужное для поиска фраз. Позиции есть только у
+    // документов, добавленных после включения, поэтому сервер должен быть пуст
+    void EnablePositions() {
+        if (!ordinal_to_id_.empty()) {
+            throw invalid_argument("Позиции слов можно включить только до добавления документов");
+        }
+        has_positions_ = true;
+    }
+
+    bool HasPositions() const {
+        return has_positions_;
+    }
+
+    // Включает сбор метрик этапов поиска. Копии сервера пишут в те же метрики,
+    // поэтому они переживают смену версий VersionedSearchServer
+    void EnableMetrics() {
+        if (metrics_ == nullptr) {
+            metrics_ = make_shared<SearchMetrics>();
+        }
+    }
+
+    void DisableMetrics() {
+        metrics_.reset();
+    }
+
+    // nullptr, если метрики выключены
+    SearchMetrics* GetMetrics() const {
+        return metrics_.get();
+    }
+
+    // Трассировка последнего FindTopDocuments, выполненного вызывающим потоком
+    static QueryTrace GetLastQueryTrace() {
+        return GetThreadQueryTrace();
+    }
+
+    // Документы с данным статусом
+    const DocumentMask& GetStatusMask(DocumentStatus status) const {
+        return status_masks_.at(static_cast<size_t>(status));
+    }
+
+    // Документы с рейтингом из отрезка [min_rating, max_rating]
+    DocumentMask MakeRatingMask(int min_rating, int max_rating) const {
+        DocumentMask result(ordinal_to_id_.size());
+        for (const auto& [document_id, ordinal] : document_ordinals_) {
+            if (min_rating <= document_ratings_[ordinal] && document_ratings_[ordinal] <= max_rating) {
+                result.Set(ordinal);
+            }
+        }
+        return result;
+    }
+
+    // Число документов, в которых встречается слово
+    int GetDocumentFreq(string_view word) const {
+        const WordEntry* entry = FindWordEntry(word);
+        return entry == nullptr ? 0 : static_cast<int>(entry->postings.GetSize());
+    }
+
+    // Найденные слова ссылаются на слова индекса и живут, пока жив сервер
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        return MatchDocument(execution::seq, ParseQuery(raw_query), document_id);
+    }
+
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(const Query& query, int document_id) const {
+        return MatchDocument(execution::seq, query, document_id);
+    }
+
+    template <typename ExecutionPolicy>
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(ExecutionPolicy&& policy, string_view raw_query,
+                                                             int document_id) const {
+        return MatchDocument(policy, ParseQuery(raw_query), document_id);
+    }
+
+    template <typename ExecutionPolicy>
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(ExecutionPolicy&& policy, const Query& query,
+                                                             int document_id) const {
+        const uint32_t ordinal = document_ordinals_.at(document_id);
+        const DocumentStatus status = document_statuses_[ordinal];
+        // Минус-слова проверяются первыми: если документ исключён, плюс-слова можно не смотреть
+        if (any_of(policy, query.minus_words.begin(), query.minus_words.end(), [this, ordinal](string_view word) {
+            return HasPosting(word, ordinal);
+        })) {
+            return {vector<string_view>{}, status};
+        }
+        // Документ без фразы запроса или с минус-фразой не подходит так же, как документ с минус-словом
+        if (HasPhrases(query)) {
+            CheckPhraseSupport();
+            const QueryArena::Scope arena_scope;
+            pmr::vector<uint32_t> positions(arena_scope.GetResource());
+            pmr::vector<uint32_t> next_positions(arena_scope.GetResource());
+            if (!MatchesPhrases(query, ordinal, positions, next_positions)) {
+                return {vector<string_view>{}, status};
+            }
+        }
+
+        vector<string_view> matched_words(query.plus_words.size());
+        transform(policy, query.plus_words.begin(), query.plus_words.end(), matched_words.begin(),
+                  [this, ordinal](string_view word) {
+            return FindIndexedWord(word, ordinal);
+        });
+        matched_words.erase(remove(matched_words.begin(), matched_words.end(), string_view{}), matched_words.end());
+        sort(policy, matched_words.begin(), matched_words.end());
+        matched_words.erase(unique(matched_words.begin(), matched_words.end()), matched_words.end());
+        return {matched_words, status};
+    }
+    
+    int GetDocumentId(int index) const {
+        return document_list_.at(index);
+    }
+
+    // Сохраняет индекс в бинарный снимок, который MappedSearchServer отображает в память
+    void SaveIndex(const string& path) const {
+        vector<SnapshotDocument> documents;
+        documents.reserve(document_ordinals_.size());
+        unordered_map<int, uint32_t> document_indexes;
+        // В снимке документы нумеруются по порядку id, а не внутренними номерами
+        vector<uint32_t> ordinal_to_index(ordinal_to_id_.size());
+        for (const auto& [document_id, ordinal] : document_ordinals_) {
+            document_indexes[document_id] = static_cast<uint32_t>(documents.size());
+            ordinal_to_index[ordinal] = static_cast<uint32_t>(documents.size());
+            documents.push_back({document_id, document_ratings_[ordinal],
+                                 static_cast<int32_t>(document_statuses_[ordinal]), 0});
+        }
+        vector<uint32_t> document_order;
+        document_order.reserve(document_list_.size());
+        for (const int document_id : document_list_) {
+            document_order.push_back(document_indexes.at(document_id));
+        }
+
+        string strings;
+        const auto add_string = [&strings](string_view text) {
+            const SnapshotString result{strings.size(), text.size()};
+            strings.append(text);
+            return result;
+        };
+
+        vector<const pair<const string_view, WordEntry>*> sorted_words;
+        for (const auto& word_entry : word_index_) {
+            if (!word_entry.second.postings.IsEmpty()) {
+                sorted_words.push_back(&word_entry);
+            }
+        }
+        sort(sorted_words.begin(), sorted_words.end(), [](const auto* lhs, const auto* rhs) {
+            return lhs->first < rhs->first;
+        });
+        vector<SnapshotWord> words;
+        words.reserve(sorted_words.size());
+        vector<SnapshotPosting> postings;
+        for (const auto* word_entry : sorted_words) {
+            const WordEntry& entry = word_entry->second;
+            words.push_back({add_string(word_entry->first), postings.size(), entry.postings.GetSize(),
+                             entry.log_document_freq});
+            const size_t first_posting = postings.size();
+            entry.postings.ForEachBlock([&](const uint32_t* ordinals, const uint32_t* term_counts, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    postings.push_back({ordinal_to_index[ordinals[i]], 0, ComputeTermFreq(term_counts[i], ordinals[i])});
+                }
+            });
+            sort(postings.begin() + first_posting, postings.end(), [](const SnapshotPosting& lhs, const SnapshotPosting& rhs) {
+                return lhs.document_index < rhs.document_index;
+            });
+        }
+        vector<SnapshotString> stop_words;
+        for (const string& word : stop_words_) {
+            stop_words.push_back(add_string(word));
+        }
+
+        SnapshotHeader header{};
+        copy(begin(SNAPSHOT_MAGIC), end(SNAPSHOT_MAGIC), header.magic);
+        header.version = SNAPSHOT_VERSION;
+        header.byte_order_mark = SNAPSHOT_BYTE_ORDER_MARK;
+        header.document_count = documents.size();
+        header.word_count = words.size();
+        header.posting_count = postings.size();
+        header.stop_word_count = stop_words.size();
+        header.log_document_count = log_document_count_;
+        uint64_t offset = AlignSnapshotOffset(sizeof(SnapshotHeader));
+        const auto place_section = [&offset](uint64_t size) {
+            const uint64_t section_offset = offset;
+            offset = AlignSnapshotOffset(offset + size);
+            return section_offset;
+        };
+        header.documents_offset = place_section(documents.size() * sizeof(SnapshotDocument));
+        header.document_order_offset = place_section(document_order.size() * sizeof(uint32_t));
+        header.words_offset = place_section(words.size() * sizeof(SnapshotWord));
+        header.postings_offset = place_section(postings.size() * sizeof(SnapshotPosting));
+        header.stop_words_offset = place_section(stop_words.size() * sizeof(SnapshotString));
+        header.strings_offset = place_section(strings.size());
+        header.strings_size = strings.size();
+
+        ofstream output(path, ios::binary | ios::trunc);
+        if (!output) {
+            throw runtime_error("Не удалось открыть файл индекса для записи: "s + path);
+        }
+        WriteSnapshotSection(output, &header, sizeof(header));
+        WriteSnapshotSection(output, documents.data(), documents.size() * sizeof(SnapshotDocument));
+        WriteSnapshotSection(output, document_order.data(), document_order.size() * sizeof(uint32_t));
+        WriteSnapshotSection(output, words.data(), words.size() * sizeof(SnapshotWord));
+        WriteSnapshotSection(output, postings.data(), postings.size() * sizeof(SnapshotPosting));
+        WriteSnapshotSection(output, stop_words.data(), stop_words.size() * sizeof(SnapshotString));
+        WriteSnapshotSection(output, strings.data(), strings.size());
+        if (!output.flush()) {
+            throw runtime_error("Не удалось записать файл индекса: "s + path);
+        }
+    }
+
+    // Разбор и проверка запроса за один проход по его тексту
+    Query ParseQuery(string_view raw_query) const {
+        SearchStageTimer timer(metrics_.get(), SearchStage::PARSE_QUERY);
+        const QueryArena::Scope arena_scope;
+        pmr::vector<string_view> words(arena_scope.GetResource());
+        Tokenize(raw_query, words);
+        return ::ParseQueryWords(words, [this](string_view word) {
+            return IsStopWord(word);
+        });
+    }
+
+private:
+    // IDF = log(N / df) хранится в виде log(N) - log(df): log(df) лежит рядом со списком
+    // вхождений и пересчитывается только при изменении этого списка, а log(N) общий
+    // для всех слов и пересчитывается один раз на добавление или удаление документа
+    struct WordEntry {
+        PostingList postings;
+        double log_document_freq = 0.0;
+        // Пусто, если сервер не хранит позиции
+        PositionList positions;
+    };
+
+    // Плотный накопитель релевантности. Нулевая релевантность тоже означает
+    // найденный документ, поэтому найденные отмечаются отдельно. Сбор результатов
+    // обнуляет все затронутые ячейки; если поиск прервался исключением, буфер
+    // остаётся грязным и очищается целиком перед следующим запросом
+    struct ScoreBuffer {
+        vector<double> scores;
+        vector<char> is_matched;
+        bool is_dirty = false;
+        bool is_in_use = false;
+
+        void Prepare(size_t ordinal_count) {
+            if (is_dirty) {
+                fill(scores.begin(), scores.end(), 0.0);
+                fill(is_matched.begin(), is_matched.end(), false);
+            }
+            if (scores.size() < ordinal_count) {
+                scores.resize(ordinal_count);
+                is_matched.resize(ordinal_count);
+            }
+            is_dirty = true;
+        }
+    };
+
+    // Отмечает буфер занятым на время поиска
+    class ScoreBufferUse {
+    public:
+        explicit ScoreBufferUse(ScoreBuffer& buffer)
+            : buffer_(buffer) {
+            buffer_.is_in_use = true;
+        }
+
+        ScoreBufferUse(const ScoreBufferUse&) = delete;
+        ScoreBufferUse& operator=(const ScoreBufferUse&) = delete;
+
+        ~ScoreBufferUse() {
+            buffer_.is_in_use = false;
+        }
+
+    private:
+        ScoreBuffer& buffer_;
+    };
+
+    // Если вхождений плюс-слов меньше числа документов в это число раз, найденные
+    // документы собираются по спискам вхождений, иначе - просмотром всего буфера
+    static constexpr size_t DENSE_SCAN_RATIO = 16;
+    // Условия поиска с отсечением: вхождений плюс-слов не меньше PRUNING_MIN_POSTINGS
+    // и не меньше PRUNING_POSTINGS_PER_RESULT на каждый запрошенный документ
+    static constexpr size_t PRUNING_MIN_POSTINGS = 4 * PostingList::BLOCK_SIZE;
+    static constexpr size_t PRUNING_POSTINGS_PER_RESULT = 64;
+    // Номера перенумеровываются, когда удалённых не меньше этого числа и больше половины всех
+    static constexpr size_t COMPACTION_MIN_REMOVED = PostingList::BLOCK_SIZE;
+
+    StopWordSet stop_words_;
+    // Единственная копия каждого слова индекса; ключи word_index_ ссылаются сюда
+    deque<string> words_storage_;
+    unordered_map<string_view, WordEntry> word_index_;
+    double log_document_count_ = 0.0;
+    vector<int> document_list_;
+    // Данные документов лежат в отдельных массивах по внутреннему номеру документа:
+    // поиск читает только рейтинги и статусы, не задевая прямой индекс
+    map<int, uint32_t> document_ordinals_;
+    // Внутренний номер -> id документа; у удалённых документов INVALID_DOCUMENT_ID
+    vector<int> ordinal_to_id_;
+    vector<int> document_ratings_;
+    vector<DocumentStatus> document_statuses_;
+    // Число слов документа без стоп-слов: TF восстанавливается из числа вхождений
+    vector<uint32_t> document_lengths_;
+    // Прямой индекс: TF каждого слова документа
+    vector<map<string_view, double>> document_word_freqs_;
+    array<DocumentMask, DOCUMENT_STATUS_COUNT> status_masks_;
+    uint64_t generation_ = AllocateGeneration();
+    // Пустой указатель - метрики выключены
+    shared_ptr<SearchMetrics> metrics_;
+    // Пустой указатель - асинхронный поиск идёт в общем пуле
+    shared_ptr<QueryExecutor> executor_;
+    bool has_positions_ = false;
+    
+    static uint64_t AllocateGeneration() {
+        static atomic<uint64_t> next_generation{0};
+        return ++next_generation;
+    }
+
+    static bool CheckQueryValidity(string_view raw_query) {
+        const vector<string_view> words = SplitIntoWords(raw_query);
+        return all_of(words.begin(), words.end(), IsValidQueryWord);
+    }
+    
+    static uint64_t AlignSnapshotOffset(uint64_t offset) {
+        return (offset + 7) / 8 * 8;
+    }
+
+    // Пишет секцию и дополняет её нулями до границы выравнивания
+    static void WriteSnapshotSection(ostream& output, const void* data, uint64_t size) {
+        output.write(static_cast<const char*>(data), static_cast<streamsize>(size));
+        static const char padding[8] = {};
+        output.write(padding, static_cast<streamsize>(AlignSnapshotOffset(size) - size));
+    }
+
+    static vector<string_view> CheckStopWordsText(string_view stop_words_text) {
+        if (!CheckQueryValidity(stop_words_text)) {
+           throw invalid_argument("Стоп слова не должны содержать недопустимые символы"); 
+        }
+        return SplitIntoWords(stop_words_text);
+    }
+
+    bool IsStopWord(string_view word) const {
+        return stop_words_.Contains(word);
+    }
+
+    template <typename WordContainer>
+    void Tokenize(string_view text, WordContainer& words) const {
+        SearchStageTimer timer(metrics_.get(), SearchStage::TOKENIZE);
+        SplitIntoWords(text, words);
+    }
+
+    // Срок и отмена текущего запроса потока. Запрос, начатый внутри другого, ограничен и
+    // своими условиями, и внешними
+    struct SearchLimits {
+        chrono::steady_clock::time_point deadline;
+        const CancellationToken* cancellation;
+        const SearchLimits* outer;
+
+        bool IsReached() const {
+            for (const SearchLimits* limits = this; limits != nullptr; limits = limits->outer) {
+                if (limits->cancellation->IsCancelled() || chrono::steady_clock::now() >= limits->deadline) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    static const SearchLimits*& GetThreadSearchLimits() {
+        thread_local const SearchLimits* limits = nullptr;
+        return limits;
+    }
+
+    // Ограничивает запросы потока, пока жив объект
+    class SearchLimitsScope {
+    public:
+        SearchLimitsScope(chrono::steady_clock::time_point deadline, const CancellationToken& cancellation)
+            : limits_{deadline, &cancellation, GetThreadSearchLimits()} {
+            GetThreadSearchLimits() = &limits_;
+        }
+
+        SearchLimitsScope(const SearchLimitsScope&) = delete;
+        SearchLimitsScope& operator=(const SearchLimitsScope&) = delete;
+
+        ~SearchLimitsScope() {
+            GetThreadSearchLimits() = limits_.outer;
+        }
+
+    private:
+        SearchLimits limits_;
+    };
+
+    // Без ограничений это одна проверка указателя. Сработавшее ограничение отмечается
+    // в трассировке, и дальше поиск его не проверяет
+    static bool IsSearchInterrupted() {
+        const SearchLimits* limits = GetThreadSearchLimits();
+        if (limits == nullptr) {
+            return false;
+        }
+        QueryTrace& trace = GetThreadQueryTrace();
+        if (!trace.is_interrupted) {
+            trace.is_interrupted = limits->IsReached();
+        }
+        return trace.is_interrupted;
+    }
+
+    static QueryTrace& GetThreadQueryTrace() {
+        thread_local QueryTrace trace;
+        return trace;
+    }
+
+    // Разобранный текст документа; слова ссылаются на этот текст
+    struct ParsedDocument {
+        map<string_view, uint32_t> term_counts;
+        // Только если сервер хранит позиции
+        map<string_view, vector<uint32_t>> word_positions;
+        uint32_t word_count = 0;
+        bool is_valid = true;
+    };
+
+    // Проверка слов и отбрасывание стоп-слов за один проход
+    ParsedDocument ParseDocument(string_view text) const {
+        ParsedDocument result;
+        vector<string_view> tokens;
+        Tokenize(text, tokens);
+        vector<string_view> words;
+        for (const string_view word : tokens) {
+            if (!IsValidQueryWord(word)) {
+                result.is_valid = false;
+                return result;
+            }
+            if (!IsStopWord(word)) {
+                words.push_back(word);
+            }
+        }
+        for (const string_view word : words) {
+            ++result.term_counts[word];
+        }
+        if (has_positions_) {
+            for (uint32_t position = 0; position < words.size(); ++position) {
+                result.word_positions[words[position]].push_back(position);
+            }
+        }
+        result.word_count = static_cast<uint32_t>(words.size());
+        return result;
+    }
+
+    static int ComputeAverageRating(const vector<int>& ratings) {
+        if (ratings.empty()) {
+            return 0;
+        }
+        int rating_sum = 0;
+        for (const int rating : ratings) {
+            rating_sum += rating;
+        }
+        return rating_sum / static_cast<int>(ratings.size());
+    }
+
+    uint32_t AllocateOrdinal(int document_id, int rating, DocumentStatus status, uint32_t word_count) {
+        const uint32_t ordinal = static_cast<uint32_t>(ordinal_to_id_.size());
+        document_ordinals_.emplace(document_id, ordinal);
+        ordinal_to_id_.push_back(document_id);
+        document_ratings_.push_back(rating);
+        document_statuses_.push_back(status);
+        document_lengths_.push_back(word_count);
+        document_word_freqs_.emplace_back();
+        status_masks_[static_cast<size_t>(status)].Set(ordinal);
+        return ordinal;
+    }
+
+    // Удалённые номера не выдаются повторно, потому что списки вхождений дописываются
+    // только в конец. Вместо этого живые документы нумеруются заново подряд в прежнем
+    // порядке: списки остаются отсортированными, а массивы по номерам снова растут с
+    // числом живых документов, а не всех когда-либо добавленных
+    void CompactOrdinals() {
+        vector<uint32_t> new_ordinals(ordinal_to_id_.size(), numeric_limits<uint32_t>::max());
+        uint32_t live_count = 0;
+        for (uint32_t ordinal = 0; ordinal < ordinal_to_id_.size(); ++ordinal) {
+            if (ordinal_to_id_[ordinal] == INVALID_DOCUMENT_ID) {
+                continue;
+            }
+            const uint32_t new_ordinal = live_count++;
+            new_ordinals[ordinal] = new_ordinal;
+            if (new_ordinal != ordinal) {
+                ordinal_to_id_[new_ordinal] = ordinal_to_id_[ordinal];
+                document_ratings_[new_ordinal] = document_ratings_[ordinal];
+                document_statuses_[new_ordinal] = document_statuses_[ordinal];
+                document_lengths_[new_ordinal] = document_lengths_[ordinal];
+                document_word_freqs_[new_ordinal] = move(document_word_freqs_[ordinal]);
+            }
+        }
+        ordinal_to_id_.resize(live_count);
+        ordinal_to_id_.shrink_to_fit();
+        document_ratings_.resize(live_count);
+        document_ratings_.shrink_to_fit();
+        document_statuses_.resize(live_count);
+        document_statuses_.shrink_to_fit();
+        document_lengths_.resize(live_count);
+        document_lengths_.shrink_to_fit();
+        document_word_freqs_.resize(live_count);
+        document_word_freqs_.shrink_to_fit();
+        for (auto& [document_id, ordinal] : document_ordinals_) {
+            ordinal = new_ordinals[ordinal];
+        }
+        for (DocumentMask& mask : status_masks_) {
+            mask = DocumentMask(live_count);
+        }
+        for (uint32_t ordinal = 0; ordinal < live_count; ++ordinal) {
+            status_masks_[static_cast<size_t>(document_statuses_[ordinal])].Set(ordinal);
+        }
+        for (auto& [word, entry] : word_index_) {
+            PostingList postings;
+            entry.postings.ForEachBlock([&](const uint32_t* ordinals, const uint32_t* term_counts, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    const uint32_t ordinal = new_ordinals[ordinals[i]];
+                    postings.Add(ordinal, term_counts[i], ComputeTermFreq(term_counts[i], ordinal));
+                }
+            });
+            entry.postings = move(postings);
+            entry.positions.Renumber(new_ordinals);
+        }
+    }
+
+    // Новое слово копируется в words_storage_, и ключом словаря становится ссылка на копию
+    // Списки вхождений удалённых слов остаются в словаре пустыми, чтобы повторное
+    // добавление слова не создавало ещё одну копию в words_storage_
+    pair<const string_view, WordEntry>& GetOrCreateWordEntry(string_view word) {
+        const auto it = word_index_.find(word);
+        if (it != word_index_.end()) {
+            return *it;
+        }
+        const string& stored_word = words_storage_.emplace_back(word);
+        return *word_index_.emplace(stored_word, WordEntry{}).first;
+    }
+
+    static void UpdateWordStatistics(WordEntry& entry) {
+        if (!entry.postings.IsEmpty()) {
+            entry.log_document_freq = log(static_cast<double>(entry.postings.GetSize()));
+        }
+    }
+
+    void UpdateDocumentCountStatistics() {
+        log_document_count_ = document_ordinals_.empty() ? 0.0 : log(static_cast<double>(document_ordinals_.size()));
+    }
+
+    // nullptr, если слово не встречается ни в одном документе
+    const WordEntry* FindWordEntry(string_view word) const {
+        const auto it = word_index_.find(word);
+        return it == word_index_.end() || it->second.postings.IsEmpty() ? nullptr : &it->second;
+    }
+
+    // Копия слова из индекса, если оно есть в документе, иначе пустая строка
+    string_view FindIndexedWord(string_view word, uint32_t ordinal) const {
+        const auto it = word_index_.find(word);
+        if (it == word_index_.end()) {
+            return {};
+        }
+        return it->second.postings.Contains(ordinal) ? it->first : string_view{};
+    }
+
+    bool HasPosting(string_view word, uint32_t ordinal) const {
+        return !FindIndexedWord(word, ordinal).empty();
+    }
+
+    double ComputeTermFreq(uint32_t term_count, uint32_t ordinal) const {
+        return static_cast<double>(term_count) / document_lengths_[ordinal];
+    }
+
+    double ComputeWordInverseDocumentFreq(const WordEntry& entry) const {
+        return log_document_count_ - entry.log_document_freq;
+    }
+
+    // IDF по статистике этого сервера
+    auto MakeLocalInverseDocumentFreq() const {
+        return [this](string_view, const WordEntry& entry) {
+            return ComputeWordInverseDocumentFreq(entry);
+        };
+    }
+
+    // Произвольный предикат вызывается на каждый найденный документ - это медленный путь.
+    // Готовые предикаты заменяются фильтром, которому не нужны id и прочие данные документа
+    template <typename DocumentPredicate>
+    auto MakePredicateFilter(const DocumentPredicate& document_predicate) const {
+        using Predicate = decay_t<DocumentPredicate>;
+        if constexpr (is_same_v<Predicate, AcceptAll>) {
+            // В списках вхождений нет удалённых документов
+            return [](uint32_t) {
+                return true;
+            };
+        } else if constexpr (IS_STATUS_PREDICATE<Predicate>) {
+            return [&status_mask = GetStatusMask(document_predicate.STATUS)](uint32_t ordinal) {
+                return status_mask.Test(ordinal);
+            };
+        } else if constexpr (IS_RATING_PREDICATE<Predicate>) {
+            return [ratings = document_ratings_.data()](uint32_t ordinal) {
+                return ratings[ordinal] >= Predicate::MIN_RATING;
+            };
+        } else {
+            return [this, &document_predicate](uint32_t ordinal) {
+                return document_predicate(ordinal_to_id_[ordinal], document_statuses_[ordinal], document_ratings_[ordinal]);
+            };
+        }
+    }
+
+    // Документы, среди которых есть max_result_count лучших. ordinal_filter(ordinal) решает,
+    // участвует ли документ в поиске, compute_idf(word, entry) задаёт IDF плюс-слова:
+    // свой или общий для корпуса. Длинные запросы по частым словам идут через отсечение,
+    // остальные - полным перебором. Временные данные и кандидаты лежат в memory
+    template <typename ExecutionPolicy, typename OrdinalFilter, typename InverseDocumentFreq>
+    pmr::vector<Document> FindTopCandidates(ExecutionPolicy&& policy, const Query& query, OrdinalFilter ordinal_filter,
+                                            InverseDocumentFreq compute_idf, size_t max_result_count,
+                                            pmr::memory_resource* memory) const {
+        QueryTrace& trace = GetThreadQueryTrace();
+        trace = QueryTrace{};
+        trace.plus_word_count = query.plus_words.size();
+        trace.minus_word_count = query.minus_words.size();
+        pmr::vector<Document> candidates(memory);
+        const auto find_candidates = [&](auto filter) {
+            if constexpr (is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>) {
+                if (IsPruningWorthwhile(query, max_result_count)) {
+                    candidates = FindTopCandidatesPruned(query, filter, compute_idf, max_result_count, memory);
+                } else {
+                    candidates = FindAllDocumentsSequential(query, filter, compute_idf, memory);
+                }
+            } else {
+                candidates = FindAllDocumentsParallel(policy, query, filter, compute_idf, memory);
+            }
+        };
+        // Фразы проверяются только у документов, прошедших фильтр. Фильтр вызывается
+        // из одного потока, поэтому буферы позиций общие на весь запрос
+        if (HasPhrases(query)) {
+            CheckPhraseSupport();
+            pmr::vector<uint32_t> positions(memory);
+            pmr::vector<uint32_t> next_positions(memory);
+            find_candidates([&](uint32_t ordinal) {
+                return ordinal_filter(ordinal) && MatchesPhrases(query, ordinal, positions, next_positions);
+            });
+        } else {
+            find_candidates(ordinal_filter);
+        }
+        trace.documents_matched = candidates.size();
+        return candidates;
+    }
+
+    void CheckPhraseSupport() const {
+        if (!has_positions_) {
+            throw invalid_argument("Поиск фраз требует позиций слов: вызовите EnablePositions до добавления документов");
+        }
+    }
+
+    bool MatchesPhrases(const Query& query, uint32_t ordinal, pmr::vector<uint32_t>& positions,
+                        pmr::vector<uint32_t>& next_positions) const {
+        return all_of(query.phrases.begin(), query.phrases.end(), [&](const QueryPhrase& phrase) {
+            return ContainsPhrase(phrase, ordinal, positions, next_positions);
+        }) && none_of(query.minus_phrases.begin(), query.minus_phrases.end(), [&](const QueryPhrase& phrase) {
+            return ContainsPhrase(phrase, ordinal, positions, next_positions);
+        });
+    }
+
+    // Позиции фразы пересекаются слово за словом: от позиций предыдущего слова остаются
+    // позиции следующего, стоящие не дальше чем через max_gap слов после какой-нибудь из них
+    bool ContainsPhrase(const QueryPhrase& phrase, uint32_t ordinal, pmr::vector<uint32_t>& positions,
+                        pmr::vector<uint32_t>& next_positions) const {
+        for (size_t i = 0; i < phrase.words.size(); ++i) {
+            const auto it = word_index_.find(phrase.words[i]);
+            if (it == word_index_.end() || !it->second.positions.Decode(ordinal, i == 0 ? positions : next_positions)) {
+                return false;
+            }
+            if (i == 0) {
+                continue;
+            }
+            // Оставшиеся позиции записываются в начало next_positions поверх уже пройденных
+            size_t kept_count = 0;
+            auto next = next_positions.begin();
+            for (const uint32_t position : positions) {
+                next = GallopUpperBound(next, next_positions.end(), position);
+                for (; next != next_positions.end() && *next - position <= uint64_t{phrase.max_gap} + 1; ++next) {
+                    next_positions[kept_count++] = *next;
+                }
+            }
+            next_positions.resize(kept_count);
+            if (next_positions.empty()) {
+                return false;
+            }
+            positions.swap(next_positions);
+        }
+        return true;
+    }
+
+    // Первая позиция больше value. Шаг от first удваивается, пока не перешагнёт value,
+    // затем в последнем шаге идёт двоичный поиск: близкие позиции находятся за O(1)
+    template <typename Iterator>
+    static Iterator GallopUpperBound(Iterator first, Iterator last, uint32_t value) {
+        const ptrdiff_t size = last - first;
+        ptrdiff_t begin = 0;
+        ptrdiff_t step = 1;
+        while (begin + step < size && first[begin + step - 1] <= value) {
+            begin += step;
+            step *= 2;
+        }
+        return upper_bound(first + begin, first + min(begin + step, size), value);
+    }
+
+    // Отбор лучших кандидатов завершает трассировку запроса. В куче оказывается только результат
+    template <typename ExecutionPolicy>
+    vector<Document> SelectTopDocuments(ExecutionPolicy&& policy, pmr::vector<Document>& candidates,
+                                        size_t max_result_count) const {
+        KeepTopCandidates(policy, candidates, max_result_count);
+        return vector<Document>(candidates.begin(), candidates.end());
+    }
+
+    template <typename ExecutionPolicy>
+    void KeepTopCandidates(ExecutionPolicy&& policy, pmr::vector<Document>& candidates, size_t max_result_count) const {
+        {
+            SearchStageTimer timer(metrics_.get(), SearchStage::SORT_TOP);
+            KeepTopDocuments(policy, candidates, max_result_count);
+        }
+        QueryTrace& trace = GetThreadQueryTrace();
+        trace.documents_returned = candidates.size();
+        if (metrics_ != nullptr) {
+            metrics_->RecordQuery(trace);
+        }
+    }
+
+    // Отсечение окупается, когда слов несколько, а вхождений намного больше, чем нужно результатов
+    bool IsPruningWorthwhile(const Query& query, size_t max_result_count) const {
+        if (max_result_count == 0 || query.plus_words.size() < 2) {
+            return false;
+        }
+        size_t posting_count = 0;
+        for (const string_view word : query.plus_words) {
+            if (const WordEntry* entry = FindWordEntry(word)) {
+                posting_count += entry->postings.GetSize();
+            }
+        }
+        return posting_count >= PRUNING_MIN_POSTINGS && posting_count >= max_result_count * PRUNING_POSTINGS_PER_RESULT;
+    }
+
+    // Поиск с досрочным отсечением по схеме MaxScore. Плюс-слова упорядочены по
+    // возрастанию наибольшего вклада в релевантность; слова, суммы вкладов которых не
+    // хватает, чтобы войти в текущие max_result_count лучших, перестают порождать
+    // кандидатов и только досчитывают кандидатов остальных слов, если те ещё могут
+    // пройти порог. Порог берётся с запасом RELEVANCE_EPSILON: документы в пределах
+    // погрешности от худшего из лучших тоже остаются кандидатами, поскольку их порядок
+    // решает рейтинг. Поэтому результат после KeepTopDocuments совпадает с полным перебором
+    template <typename OrdinalFilter, typename InverseDocumentFreq>
+    pmr::vector<Document> FindTopCandidatesPruned(const Query& query, OrdinalFilter ordinal_filter,
+                                                  InverseDocumentFreq compute_idf, size_t max_result_count,
+                                                  pmr::memory_resource* memory) const {
+        struct PlusTerm {
+            PostingCursor cursor;
+            double inverse_document_freq;
+            double max_score;
+            size_t query_index;
+        };
+        pmr::vector<PlusTerm> terms(memory);
+        terms.reserve(query.plus_words.size());
+        for (size_t i = 0; i < query.plus_words.size(); ++i) {
+            const WordEntry* entry = FindWordEntry(query.plus_words[i]);
+            if (entry == nullptr) {
+                continue;
+            }
+            const double inverse_document_freq = compute_idf(query.plus_words[i], *entry);
+            // Оценки сверху верны только для неотрицательных вкладов
+            if (inverse_document_freq < 0.0) {
+                return FindAllDocumentsSequential(query, ordinal_filter, compute_idf, memory);
+            }
+            double max_term_freq = 0.0;
+            for (size_t block = 0; block < entry->postings.GetBlockCount(); ++block) {
+                max_term_freq = max(max_term_freq, entry->postings.GetBlockInfo(block).max_term_freq);
+            }
+            terms.push_back({PostingCursor(entry->postings), inverse_document_freq,
+                             max_term_freq * inverse_document_freq, i});
+        }
+        sort(terms.begin(), terms.end(), [](const PlusTerm& lhs, const PlusTerm& rhs) {
+            return lhs.max_score < rhs.max_score;
+        });
+        // upper_bounds[i] - наибольшая сумма вкладов слов terms[0..i]
+        pmr::vector<double> upper_bounds(terms.size(), memory);
+        for (size_t i = 0; i < terms.size(); ++i) {
+            upper_bounds[i] = (i > 0 ? upper_bounds[i - 1] : 0.0) + terms[i].max_score;
+        }
+        pmr::vector<PostingCursor> minus_cursors(memory);
+        minus_cursors.reserve(query.minus_words.size());
+        for (const string_view word : query.minus_words) {
+            if (const WordEntry* entry = FindWordEntry(word)) {
+                minus_cursors.emplace_back(entry->postings);
+            }
+        }
+
+        SearchStageTimer timer(metrics_.get(), SearchStage::SCORE);
+        pmr::vector<Document> candidates(memory);
+        priority_queue<double, pmr::vector<double>, greater<double>> top_relevances(greater<double>{},
+                                                                                    pmr::vector<double>(memory));
+        double threshold = -numeric_limits<double>::infinity();
+        size_t first_essential = 0;
+        // Вклады слов в релевантность кандидата в порядке query.plus_words: сумма в этом
+        // порядке побитно совпадает с суммой, которую считает полный перебор
+        pmr::vector<double> contributions(query.plus_words.size(), memory);
+        // Ограничения запроса проверяются раз в BLOCK_SIZE кандидатов
+        for (size_t step = 1;; ++step) {
+            if (step % PostingList::BLOCK_SIZE == 0 && IsSearchInterrupted()) {
+                break;
+            }
+            uint32_t ordinal = PostingCursor::END;
+            for (size_t i = first_essential; i < terms.size(); ++i) {
+                ordinal = min(ordinal, terms[i].cursor.GetOrdinal());
+            }
+            if (ordinal == PostingCursor::END) {
+                break;
+            }
+            fill(contributions.begin(), contributions.end(), 0.0);
+            double score_bound = 0.0;
+            for (size_t i = first_essential; i < terms.size(); ++i) {
+                PostingCursor& cursor = terms[i].cursor;
+                if (cursor.GetOrdinal() == ordinal) {
+                    const double contribution = ComputeTermFreq(cursor.GetTermCount(), ordinal) * terms[i].inverse_document_freq;
+                    contributions[terms[i].query_index] = contribution;
+                    score_bound += contribution;
+                    cursor.Next();
+                }
+            }
+            bool is_pruned = false;
+            for (size_t i = first_essential; i-- > 0;) {
+                const double rest_bound = i > 0 ? upper_bounds[i - 1] : 0.0;
+                if (score_bound + upper_bounds[i] < threshold - RELEVANCE_EPSILON) {
+                    is_pruned = true;
+                    break;
+                }
+                PostingCursor& cursor = terms[i].cursor;
+                cursor.ShallowSeek(ordinal);
+                // Граница блока точнее границы всего списка
+                const double block_bound = cursor.GetBlockMaxTermFreq() * terms[i].inverse_document_freq;
+                if (score_bound + block_bound + rest_bound < threshold - RELEVANCE_EPSILON) {
+                    is_pruned = true;
+                    break;
+                }
+                cursor.Seek(ordinal);
+                if (cursor.GetOrdinal() == ordinal) {
+                    const double contribution = ComputeTermFreq(cursor.GetTermCount(), ordinal) * terms[i].inverse_document_freq;
+                    contributions[terms[i].query_index] = contribution;
+                    score_bound += contribution;
+                }
+            }
+            if (is_pruned || !ordinal_filter(ordinal)) {
+                continue;
+            }
+            if (any_of(minus_cursors.begin(), minus_cursors.end(), [ordinal](PostingCursor& cursor) {
+                cursor.Seek(ordinal);
+                return cursor.GetOrdinal() == ordinal;
+            })) {
+                continue;
+            }
+            double relevance = 0.0;
+            for (const double contribution : contributions) {
+                relevance += contribution;
+            }
+            if (relevance < threshold - RELEVANCE_EPSILON) {
+                continue;
+            }
+            candidates.push_back({ordinal_to_id_[ordinal], relevance, document_ratings_[ordinal]});
+            top_relevances.push(relevance);
+            if (top_relevances.size() > max_result_count) {
+                top_relevances.pop();
+            }
+            if (top_relevances.size() == max_result_count) {
+                threshold = top_relevances.top();
+                while (first_essential < terms.size() && upper_bounds[first_essential] < threshold - RELEVANCE_EPSILON) {
+                    ++first_essential;
+                }
+            }
+        }
+        // Кандидаты здесь - только документы, прошедшие порог на момент своего подсчёта
+        QueryTrace& trace = GetThreadQueryTrace();
+        trace.is_pruned = true;
+        for (const PlusTerm& term : terms) {
+            trace.postings_scanned += term.cursor.GetDecodedCount();
+        }
+        for (const PostingCursor& cursor : minus_cursors) {
+            trace.postings_scanned += cursor.GetDecodedCount();
+        }
+        return candidates;
+    }
+
+    // Релевантность накапливается в плотном массиве по внутреннему номеру документа.
+    // Буфер свой у каждого потока и переиспользуется между запросами
+    template <typename OrdinalFilter, typename InverseDocumentFreq>
+    pmr::vector<Document> FindAllDocumentsSequential(const Query& query, OrdinalFilter ordinal_filter,
+                                                     InverseDocumentFreq compute_idf, pmr::memory_resource* memory) const {
+        thread_local ScoreBuffer buffer;
+        buffer.Prepare(ordinal_to_id_.size());
+        pmr::vector<const PostingList*> plus_postings(memory);
+        plus_postings.reserve(query.plus_words.size());
+        {
+            SearchStageTimer timer(metrics_.get(), SearchStage::SCORE);
+            for (const string_view word : query.plus_words) {
+                const WordEntry* entry = FindWordEntry(word);
+                if (entry == nullptr) {
+                    continue;
+                }
+                const PostingList& postings = entry->postings;
+                const double inverse_document_freq = compute_idf(word, *entry);
+                // Первый блок считается всегда, чтобы остановленный поиск что-то вернул
+                for (size_t block = 0; block < postings.GetBlockCount(); ++block) {
+                    if ((block > 0 || !plus_postings.empty()) && IsSearchInterrupted()) {
+                        break;
+                    }
+                    AccumulateBlockScores(postings, block, inverse_document_freq, buffer.scores.data(), buffer.is_matched.data());
+                }
+                plus_postings.push_back(&postings);
+                if (GetThreadQueryTrace().is_interrupted) {
+                    break;
+                }
+            }
+        }
+        ExcludeMinusWords(execution::seq, query, buffer.scores.data(), buffer.is_matched.data(), memory);
+        pmr::vector<Document> matched_documents = CollectMatchedDocuments(plus_postings, ordinal_filter,
+                                                                          buffer.scores.data(), buffer.is_matched.data(),
+                                                                          memory);
+        buffer.is_dirty = false;
+        return matched_documents;
+    }
+
+    // Слова обрабатываются по очереди, а блоки списка вхождений одного слова - параллельно:
+    // в списке каждый документ встречается один раз, и потоки пишут в разные ячейки
+    template <typename ExecutionPolicy, typename OrdinalFilter, typename InverseDocumentFreq>
+    pmr::vector<Document> FindAllDocumentsParallel(ExecutionPolicy&& policy, const Query& query,
+                                                   OrdinalFilter ordinal_filter, InverseDocumentFreq compute_idf,
+                                                   pmr::memory_resource* memory) const {
+        // Буфер вызывающего потока переиспользуется, как в последовательном поиске: его
+        // ячейки обнуляются по вхождениям, а не целиком. Если поток, ожидая параллельный
+        // алгоритм, взялся за другой такой же поиск, тому достаётся временный буфер
+        thread_local ScoreBuffer thread_buffer;
+        ScoreBuffer temporary_buffer;
+        ScoreBuffer& buffer = thread_buffer.is_in_use ? temporary_buffer : thread_buffer;
+        buffer.Prepare(ordinal_to_id_.size());
+        const ScoreBufferUse buffer_use(buffer);
+        double* const scores = buffer.scores.data();
+        char* const is_matched = buffer.is_matched.data();
+        pmr::vector<const PostingList*> plus_postings(memory);
+        plus_postings.reserve(query.plus_words.size());
+        {
+            SearchStageTimer timer(metrics_.get(), SearchStage::SCORE);
+            for (const string_view word : query.plus_words) {
+                const WordEntry* entry = FindWordEntry(word);
+                if (entry == nullptr) {
+                    continue;
+                }
+                const PostingList& postings = entry->postings;
+                const double inverse_document_freq = compute_idf(word, *entry);
+                pmr::vector<size_t> blocks(postings.GetBlockCount(), memory);
+                iota(blocks.begin(), blocks.end(), 0);
+                for_each(policy, blocks.begin(), blocks.end(), [&](size_t block) {
+                    AccumulateBlockScores(postings, block, inverse_document_freq, scores, is_matched);
+                });
+                plus_postings.push_back(&postings);
+            }
+        }
+        ExcludeMinusWords(policy, query, scores, is_matched, memory);
+        pmr::vector<Document> matched_documents = CollectMatchedDocuments(plus_postings, ordinal_filter, scores,
+                                                                          is_matched, memory);
+        buffer.is_dirty = false;
+        return matched_documents;
+    }
+
+    // Распаковывает блок, восстанавливает TF и передаёт его ядру подсчёта релевантности
+    void AccumulateBlockScores(const PostingList& postings, size_t block, double inverse_document_freq,
+                               double* scores, char* is_matched) const {
+        uint32_t ordinals[PostingList::BLOCK_SIZE];
+        uint32_t term_counts[PostingList::BLOCK_SIZE];
+        double term_freqs[PostingList::BLOCK_SIZE];
+        const size_t count = postings.DecodeBlock(block, ordinals, term_counts);
+        for (size_t i = 0; i < count; ++i) {
+            term_freqs[i] = ComputeTermFreq(term_counts[i], ordinals[i]);
+        }
+        GetAccumulateScoresKernel()(ordinals, term_freqs, count, inverse_document_freq, scores, is_matched);
+    }
+
+    template <typename ExecutionPolicy>
+    void ExcludeMinusWords(ExecutionPolicy&& policy, const Query& query, double* scores, char* is_matched,
+                           pmr::memory_resource* memory) const {
+        SearchStageTimer timer(metrics_.get(), SearchStage::EXCLUDE_MINUS_WORDS);
+        QueryTrace& trace = GetThreadQueryTrace();
+        for (const string_view word : query.minus_words) {
+            const WordEntry* entry = FindWordEntry(word);
+            if (entry == nullptr) {
+                continue;
+            }
+            const PostingList& postings = entry->postings;
+            trace.postings_scanned += postings.GetSize();
+            pmr::vector<size_t> blocks(postings.GetBlockCount(), memory);
+            iota(blocks.begin(), blocks.end(), 0);
+            for_each(policy, blocks.begin(), blocks.end(), [&postings, scores, is_matched](size_t block) {
+                uint32_t ordinals[PostingList::BLOCK_SIZE];
+                uint32_t term_counts[PostingList::BLOCK_SIZE];
+                const size_t count = postings.DecodeBlock(block, ordinals, term_counts);
+                for (size_t i = 0; i < count; ++i) {
+                    scores[ordinals[i]] = 0.0;
+                    is_matched[ordinals[i]] = false;
+                }
+            });
+        }
+    }
+
+    // Фильтр применяется к найденным документам, а не к каждому вхождению.
+    // Все просмотренные ячейки буфера обнуляются
+    template <typename OrdinalFilter>
+    pmr::vector<Document> CollectMatchedDocuments(const pmr::vector<const PostingList*>& plus_postings,
+                                                  OrdinalFilter ordinal_filter, double* scores, char* is_matched,
+                                                  pmr::memory_resource* memory) const {
+        size_t posting_count = 0;
+        for (const PostingList* postings : plus_postings) {
+            posting_count += postings->GetSize();
+        }
+        // Полный перебор распаковывает все вхождения плюс-слов; минус-слова учтены в ExcludeMinusWords
+        GetThreadQueryTrace().postings_scanned += posting_count;
+        // Найденных не больше, чем вхождений: векторы не растут по ходу сбора
+        pmr::vector<uint32_t> matched_ordinals(memory);
+        matched_ordinals.reserve(min(posting_count, ordinal_to_id_.size()));
+        if (posting_count * DENSE_SCAN_RATIO < ordinal_to_id_.size()) {
+            for (const PostingList* postings : plus_postings) {
+                postings->ForEachBlock([&](const uint32_t* ordinals, const uint32_t*, size_t count) {
+                    for (size_t i = 0; i < count; ++i) {
+                        if (is_matched[ordinals[i]]) {
+                            matched_ordinals.push_back(ordinals[i]);
+                            is_matched[ordinals[i]] = false;
+                        }
+                    }
+                });
+            }
+        } else {
+            GetCollectMatchedKernel()(is_matched, ordinal_to_id_.size(), matched_ordinals);
+            for (const uint32_t ordinal : matched_ordinals) {
+                is_matched[ordinal] = false;
+            }
+        }
+
+        pmr::vector<Document> matched_documents(memory);
+        matched_documents.reserve(matched_ordinals.size());
+        for (const uint32_t ordinal : matched_ordinals) {
+            if (ordinal_filter(ordinal)) {
+                matched_documents.push_back({ordinal_to_id_[ordinal], scores[ordinal], document_ratings_[ordinal]});
+            }
+            scores[ordinal] = 0.0;
+        }
+        return matched_documents;
+    }
+};
+
+// Файл, отображённый в память только для чтения
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            throw runtime_error("Не удалось открыть файл: "s + path);
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+            CloseHandle(file_);
+            throw runtime_error("Не удалось отобразить файл: "s + path);
+        }
+        size_ = static_cast<size_t>(size.QuadPart);
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_ != nullptr) {
+            data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        }
+        if (data_ == nullptr) {
+            if (mapping_ != nullptr) {
+                CloseHandle(mapping_);
+            }
+            CloseHandle(file_);
+            throw runtime_error("Не удалось отобразить файл: "s + path);
+        }
+#else
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            throw runtime_error("Не удалось открыть файл: "s + path);
+        }
+        struct stat file_stat;
+        void* data = MAP_FAILED;
+        if (fstat(descriptor, &file_stat) == 0 && file_stat.st_size > 0) {
+            size_ = static_cast<size_t>(file_stat.st_size);
+            data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, descriptor, 0);
+        }
+        // Отображение остаётся действительным и после закрытия дескриптора
+        close(descriptor);
+        if (data == MAP_FAILED) {
+            throw runtime_error("Не удалось отобразить файл: "s + path);
+        }
+        data_ = static_cast<const char*>(data);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+        CloseHandle(file_);
+#else
+        munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+};
+
+// Поиск по снимку, сохранённому SearchServer::SaveIndex. Снимок не разбирается
+// в словари: запросы обслуживаются прямо из отображённых в память страниц,
+// поэтому открытие занимает время, не зависящее от размера индекса
+class MappedSearchServer {
+public:
+    using Query = ::Query;
+
+    explicit MappedSearchServer(const string& path)
+        : file_(path) {
+        if (file_.GetSize() < sizeof(SnapshotHeader)) {
+            throw runtime_error("Файл не является снимком индекса: "s + path);
+        }
+        header_ = reinterpret_cast<const SnapshotHeader*>(file_.GetData());
+        if (!equal(begin(SNAPSHOT_MAGIC), end(SNAPSHOT_MAGIC), header_->magic)
+            || header_->byte_order_mark != SNAPSHOT_BYTE_ORDER_MARK) {
+            throw runtime_error("Файл не является снимком индекса: "s + path);
+        }
+        if (header_->version != SNAPSHOT_VERSION) {
+            throw runtime_error("Неподдерживаемая версия снимка индекса: "s + to_string(header_->version));
+        }
+        documents_ = GetSection<SnapshotDocument>(header_->documents_offset, header_->document_count);
+        document_order_ = GetSection<uint32_t>(header_->document_order_offset, header_->document_count);
+        words_ = GetSection<SnapshotWord>(header_->words_offset, header_->word_count);
+        postings_ = GetSection<SnapshotPosting>(header_->postings_offset, header_->posting_count);
+        stop_words_ = GetSection<SnapshotString>(header_->stop_words_offset, header_->stop_word_count);
+        strings_ = GetSection<char>(header_->strings_offset, header_->strings_size);
+        // Номера документов проверяются один раз здесь, а не при каждом запросе
+        if (any_of(postings_.begin(), postings_.end(), [this](const SnapshotPosting& posting) {
+            return posting.document_index >= documents_.size();
+        }) || any_of(document_order_.begin(), document_order_.end(), [this](uint32_t document_index) {
+            return document_index >= documents_.size();
+        })) {
+            throw runtime_error("Снимок индекса повреждён"s);
+        }
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentPredicate document_predicate,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(ParseQuery(raw_query), document_predicate, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(ParseQuery(raw_query), [status](int, DocumentStatus document_status, int) {
+            return document_status == status;
+        }, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query) const {
+        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(const Query& query, DocumentPredicate document_predicate,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        if (HasPhrases(query)) {
+            throw invalid_argument("Снимок индекса не хранит позиций слов, поиск фраз недоступен");
+        }
+        map<uint32_t, double> document_to_relevance;
+        for (const string_view word : query.plus_words) {
+            const SnapshotWord* entry = FindWord(word);
+            if (entry == nullptr) {
+                continue;
+            }
+            const double inverse_document_freq = header_->log_document_count - entry->log_document_freq;
+            for (const SnapshotPosting& posting : GetPostings(*entry)) {
+                const SnapshotDocument& document = documents_[posting.document_index];
+                if (document_predicate(document.id, static_cast<DocumentStatus>(document.status), document.rating)) {
+                    document_to_relevance[posting.document_index] += posting.term_freq * inverse_document_freq;
+                }
+            }
+        }
+        for (const string_view word : query.minus_words) {
+            const SnapshotWord* entry = FindWord(word);
+            if (entry == nullptr) {
+                continue;
+            }
+            for (const SnapshotPosting& posting : GetPostings(*entry)) {
+                document_to_relevance.erase(posting.document_index);
+            }
+        }
+
+        vector<Document> matched_documents;
+        matched_documents.reserve(document_to_relevance.size());
+        for (const auto& [document_index, relevance] : document_to_relevance) {
+            const SnapshotDocument& document = documents_[document_index];
+            matched_documents.push_back({document.id, relevance, document.rating});
+        }
+        KeepTopDocuments(execution::seq, matched_documents, max_result_count);
+        return matched_documents;
+    }
+
+    int GetDocumentCount() const {
+        return static_cast<int>(documents_.size());
+    }
+
+    int GetDocumentId(int index) const {
+        if (index < 0 || static_cast<size_t>(index) >= document_order_.size()) {
+            throw out_of_range("Нет документа с индексом "s + to_string(index));
+        }
+        return documents_[document_order_[index]].id;
+    }
+
+    Query ParseQuery(string_view raw_query) const {
+        return ::ParseQuery(raw_query, [this](string_view word) {
+            return IsStopWord(word);
+        });
+    }
+
+private:
+    // Непрерывный участок отображённого файла
+    template <typename T>
+    struct Section {
+        const T* data = nullptr;
+        size_t count = 0;
+
+        const T* begin() const {
+            return data;
+        }
+        const T* end() const {
+            return data + count;
+        }
+        size_t size() const {
+            return count;
+        }
+        const T& operator[](size_t index) const {
+            return data[index];
+        }
+    };
+
+    MappedFile file_;
+    const SnapshotHeader* header_ = nullptr;
+    Section<SnapshotDocument> documents_;
+    Section<uint32_t> document_order_;
+    Section<SnapshotWord> words_;
+    Section<SnapshotPosting> postings_;
+    Section<SnapshotString> stop_words_;
+    Section<char> strings_;
+
+    template <typename T>
+    Section<T> GetSection(uint64_t offset, uint64_t count) const {
+        if (offset % alignof(T) != 0 || offset > file_.GetSize()
+            || count > (file_.GetSize() - offset) / sizeof(T)) {
+            throw runtime_error("Снимок индекса повреждён"s);
+        }
+        return {reinterpret_cast<const T*>(file_.GetData() + offset), static_cast<size_t>(count)};
+    }
+
+    string_view GetString(const SnapshotString& text) const {
+        if (text.offset > strings_.size() || text.size > strings_.size() - text.offset) {
+            throw runtime_error("Снимок индекса повреждён"s);
+        }
+        return {strings_.data + text.offset, static_cast<size_t>(text.size)};
+    }
+
+    Section<SnapshotPosting> GetPostings(const SnapshotWord& word) const {
+        if (word.first_posting > postings_.size() || word.posting_count > postings_.size() - word.first_posting) {
+            throw runtime_error("Снимок индекса повреждён"s);
+        }
+        return {postings_.data + word.first_posting, static_cast<size_t>(word.posting_count)};
+    }
+
+    // Словарь и стоп-слова отсортированы, поиск - двоичный
+    const SnapshotWord* FindWord(string_view word) const {
+        const auto it = lower_bound(words_.begin(), words_.end(), word,
+                                    [this](const SnapshotWord& entry, string_view word) {
+            return GetString(entry.text) < word;
+        });
+        return it != words_.end() && GetString(it->text) == word ? it : nullptr;
+    }
+
+    bool IsStopWord(string_view word) const {
+        const auto it = lower_bound(stop_words_.begin(), stop_words_.end(), word,
+                                    [this](const SnapshotString& entry, string_view word) {
+            return GetString(entry) < word;
+        });
+        return it != stop_words_.end() && GetString(*it) == word;
+    }
+};
+
+// Часть корпуса для ShardedSearchServer. Интерфейс не передаёт предикаты и
+// ссылки на внутренние структуры, поэтому часть может жить и в другом процессе:
+// достаточно реализовать эти методы поверх RPC
+class SearchShard {
+public:
+    virtual ~SearchShard() = default;
+
+    virtual void AddDocument(int document_id, string_view document, DocumentStatus status,
+                             const vector<int>& ratings) = 0;
+    virtual void RemoveDocument(int document_id) = 0;
+    virtual int GetDocumentCount() const = 0;
+    // Число документов части с каждым из слов
+    virtual vector<int> GetDocumentFreqs(const vector<string_view>& words) const = 0;
+    // Лучшие документы части, ранжированные по IDF всего корпуса
+    virtual vector<Document> FindTopDocuments(const Query& query, const vector<double>& plus_word_idfs,
+                                              DocumentStatus status, size_t max_result_count) const = 0;
+};
+
+// Часть корпуса в памяти этого процесса
+class LocalSearchShard : public SearchShard {
+public:
+    explicit LocalSearchShard(SearchServer server)
+        : server_(move(server)) {
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status,
+                     const vector<int>& ratings) override {
+        server_.AddDocument(document_id, document, status, ratings);
+    }
+
+    void RemoveDocument(int document_id) override {
+        server_.RemoveDocument(document_id);
+    }
+
+    int GetDocumentCount() const override {
+        return server_.GetDocumentCount();
+    }
+
+    vector<int> GetDocumentFreqs(const vector<string_view>& words) const override {
+        vector<int> document_freqs(words.size());
+        transform(words.begin(), words.end(), document_freqs.begin(), [this](string_view word) {
+            return server_.GetDocumentFreq(word);
+        });
+        return document_freqs;
+    }
+
+    vector<Document> FindTopDocuments(const Query& query, const vector<double>& plus_word_idfs,
+                                      DocumentStatus status, size_t max_result_count) const override {
+        return server_.FindTopDocumentsWithIdf(execution::seq, query, plus_word_idfs,
+                                               [status](int, DocumentStatus document_status, int) {
+            return document_status == status;
+        }, max_result_count);
+    }
+
+private:
+    SearchServer server_;
+};
+
+// Корпус, разбитый по id документа между несколькими частями. Запрос рассылается
+// всем частям: сначала собираются N и df плюс-слов по всему корпусу, затем каждая
+// часть возвращает свои лучшие документы по общему IDF, и они сливаются тем же
+// порядком выдачи. Ранжирование совпадает с одним SearchServer на весь корпус
+class ShardedSearchServer {
+public:
+    using Query = ::Query;
+
+    ShardedSearchServer(const string& stop_words_text, size_t shard_count)
+        : query_parser_(stop_words_text) {
+        if (shard_count == 0) {
+            throw invalid_argument("Нужна хотя бы одна часть корпуса");
+        }
+        for (size_t i = 0; i < shard_count; ++i) {
+            shards_.push_back(make_unique<LocalSearchShard>(SearchServer(stop_words_text)));
+        }
+    }
+
+    // Части должны использовать те же стоп-слова
+    ShardedSearchServer(const string& stop_words_text, vector<unique_ptr<SearchShard>> shards)
+        : query_parser_(stop_words_text), shards_(move(shards)) {
+        if (shards_.empty()) {
+            throw invalid_argument("Нужна хотя бы одна часть корпуса");
+        }
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        GetShard(document_id).AddDocument(document_id, document, status, ratings);
+    }
+
+    void RemoveDocument(int document_id) {
+        GetShard(document_id).RemoveDocument(document_id);
+    }
+
+    int GetDocumentCount() const {
+        int document_count = 0;
+        for (const auto& shard : shards_) {
+            document_count += shard->GetDocumentCount();
+        }
+        return document_count;
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(query_parser_.ParseQuery(raw_query), status, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(const Query& query, DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        // Исключение внутри параллельного алгоритма завершило бы программу, поэтому фразы
+        // отклоняются до обращения к частям
+        if (HasPhrases(query)) {
+            throw invalid_argument("Части корпуса не хранят позиций слов, поиск фраз недоступен");
+        }
+        const vector<double> plus_word_idfs = ComputeInverseDocumentFreqs(query);
+        // Ошибка части, например удалённой, выбрасывается в вызывающем потоке
+        vector<vector<Document>> shard_documents(shards_.size());
+        ForEachIndexParallel(shards_.size(), [&](size_t i) {
+            shard_documents[i] = shards_[i]->FindTopDocuments(query, plus_word_idfs, status, max_result_count);
+        });
+
+        vector<Document> matched_documents;
+        for (const vector<Document>& documents : shard_documents) {
+            matched_documents.insert(matched_documents.end(), documents.begin(), documents.end());
+        }
+        KeepTopDocuments(execution::seq, matched_documents, max_result_count);
+        return matched_documents;
+    }
+
+    Query ParseQuery(string_view raw_query) const {
+        return query_parser_.ParseQuery(raw_query);
+    }
+
+private:
+    // Пустой сервер с теми же стоп-словами разбирает запросы так же, как части
+    SearchServer query_parser_;
+    vector<unique_ptr<SearchShard>> shards_;
+
+    // Отрицательные id попадают в первую часть, и она отклоняет их как обычно
+    SearchShard& GetShard(int document_id) const {
+        return document_id < 0 ? *shards_.front() : *shards_[static_cast<size_t>(document_id) % shards_.size()];
+    }
+
+    // IDF считается так же, как в SearchServer: log(N) - log(df)
+    vector<double> ComputeInverseDocumentFreqs(const Query& query) const {
+        vector<int> document_counts(shards_.size());
+        vector<vector<int>> document_freqs(shards_.size());
+        ForEachIndexParallel(shards_.size(), [&](size_t i) {
+            document_counts[i] = shards_[i]->GetDocumentCount();
+            document_freqs[i] = shards_[i]->GetDocumentFreqs(query.plus_words);
+        });
+
+        const int document_count = accumulate(document_counts.begin(), document_counts.end(), 0);
+        const double log_document_count = document_count == 0 ? 0.0 : log(static_cast<double>(document_count));
+        vector<double> plus_word_idfs(query.plus_words.size(), 0.0);
+        for (size_t word = 0; word < plus_word_idfs.size(); ++word) {
+            int document_freq = 0;
+            for (const vector<int>& shard_freqs : document_freqs) {
+                document_freq += shard_freqs[word];
+            }
+            if (document_freq > 0) {
+                plus_word_idfs[word] = log_document_count - log(static_cast<double>(document_freq));
+            }
+        }
+        return plus_word_idfs;
+    }
+};
+
+// Индекс из сегментов. Новые документы попадают в небольшой изменяемый сегмент; заполненный
+// сегмент запечатывается: копия сжимает его словарь, и больше он не меняется. Фоновый поток
+// сливает MERGE_FACTOR запечатанных сегментов одного уровня размера в один и выбрасывает
+// при этом удалённые документы. Удаление из запечатанного сегмента оставляет отметку,
+// которую поиск и IDF учитывают до слияния. Поиск идёт по всем сегментам с общим для
+// корпуса IDF, поэтому ранжирование совпадает с одним SearchServer на весь корпус
+class SegmentedSearchServer {
+public:
+    using Query = ::Query;
+
+    static constexpr size_t DEFAULT_SEGMENT_CAPACITY = 4096;
+    static constexpr size_t MERGE_FACTOR = 4;
+
+    explicit SegmentedSearchServer(const string& stop_words_text, size_t segment_capacity = DEFAULT_SEGMENT_CAPACITY)
+        : stop_words_text_(stop_words_text)
+        , segment_capacity_(segment_capacity)
+        , query_parser_(stop_words_text)
+        , mutable_segment_(stop_words_text) {
+        if (segment_capacity == 0) {
+            throw invalid_argument("Ёмкость сегмента должна быть положительной");
+        }
+        merge_thread_ = thread([this] {
+            RunMerges();
+        });
+    }
+
+    SegmentedSearchServer(const SegmentedSearchServer&) = delete;
+    SegmentedSearchServer& operator=(const SegmentedSearchServer&) = delete;
+
+    ~SegmentedSearchServer() {
+        {
+            lock_guard guard(segments_mutex_);
+            is_stopping_ = true;
+        }
+        merge_condition_.notify_all();
+        merge_thread_.join();
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        lock_guard guard(segments_mutex_);
+        if (FindSealedSegment(document_id) != nullptr) {
+            throw invalid_argument("Нельзя добавлять документы с отрицательным id или уже существуюищим id");
+        }
+        mutable_segment_.AddDocument(document_id, document, status, ratings);
+        if (static_cast<size_t>(mutable_segment_.GetDocumentCount()) >= segment_capacity_) {
+            SealMutableSegment();
+        }
+    }
+
+    // Несуществующий id игнорируется
+    void RemoveDocument(int document_id) {
+        lock_guard guard(segments_mutex_);
+        if (mutable_segment_.HasDocument(document_id)) {
+            mutable_segment_.RemoveDocument(document_id);
+        } else if (Segment* segment = FindSealedSegment(document_id)) {
+            segment->deleted_ids.insert(document_id);
+            // Сегмент, в котором больше половины удалено, переписывается и без пары
+            merge_condition_.notify_all();
+        }
+    }
+
+    // Запечатывает изменяемый сегмент, даже если он не заполнен. Ошибка последнего
+    // слияния выбрасывается здесь, после чего слияния возобновляются
+    void Flush() {
+        lock_guard guard(segments_mutex_);
+        if (mutable_segment_.GetDocumentCount() > 0) {
+            SealMutableSegment();
+        }
+        RethrowMergeError();
+    }
+
+    // Ждёт, пока фоновый поток не сольёт всё, что можно слить. Если слияние не удалось,
+    // выбрасывает его ошибку: входные сегменты остаются нетронутыми
+    void WaitForMerges() const {
+        unique_lock lock(segments_mutex_);
+        merge_condition_.wait(lock, [this] {
+            return merge_error_ != nullptr || (!is_merging_ && FindMergeCandidates().empty());
+        });
+        RethrowMergeError();
+    }
+
+    int GetDocumentCount() const {
+        shared_lock lock(segments_mutex_);
+        int document_count = mutable_segment_.GetDocumentCount();
+        for (const Segment& segment : sealed_segments_) {
+            document_count += GetLiveDocumentCount(segment);
+        }
+        return document_count;
+    }
+
+    // Запечатанные сегменты и непустой изменяемый
+    size_t GetSegmentCount() const {
+        shared_lock lock(segments_mutex_);
+        return sealed_segments_.size() + (mutable_segment_.GetDocumentCount() > 0 ? 1 : 0);
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(query_parser_.ParseQuery(raw_query), status, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(const Query& query, DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        // Исключение внутри параллельного алгоритма завершило бы программу, поэтому фразы
+        // отклоняются до обращения к сегментам
+        if (HasPhrases(query)) {
+            throw invalid_argument("Сегменты не хранят позиций слов, поиск фраз недоступен");
+        }
+        shared_lock lock(segments_mutex_);
+        const vector<double> plus_word_idfs = ComputeInverseDocumentFreqs(query);
+        vector<const Segment*> segments;
+        for (const Segment& segment : sealed_segments_) {
+            segments.push_back(&segment);
+        }
+        vector<vector<Document>> segment_documents(segments.size());
+        transform(execution::par, segments.begin(), segments.end(), segment_documents.begin(),
+                  [&](const Segment* segment) {
+            return segment->server->FindTopDocumentsWithIdf(execution::seq, query, plus_word_idfs,
+                                                            [segment, status](int document_id, DocumentStatus document_status, int) {
+                return document_status == status && segment->deleted_ids.count(document_id) == 0;
+            }, max_result_count);
+        });
+
+        vector<Document> matched_documents = mutable_segment_.FindTopDocumentsWithIdf(execution::seq, query, plus_word_idfs,
+                                                                                      [status](int, DocumentStatus document_status, int) {
+            return document_status == status;
+        }, max_result_count);
+        for (const vector<Document>& documents : segment_documents) {
+            matched_documents.insert(matched_documents.end(), documents.begin(), documents.end());
+        }
+        KeepTopDocuments(execution::seq, matched_documents, max_result_count);
+        return matched_documents;
+    }
+
+    Query ParseQuery(string_view raw_query) const {
+        return query_parser_.ParseQuery(raw_query);
+    }
+
+private:
+    struct Segment {
+        shared_ptr<const SearchServer> server;
+        // Удалённые, но ещё не выброшенные слиянием документы сегмента
+        unordered_set<int> deleted_ids;
+    };
+
+    static int GetLiveDocumentCount(const Segment& segment) {
+        return segment.server->GetDocumentCount() - static_cast<int>(segment.deleted_ids.size());
+    }
+
+    // Живая копия документа есть не больше чем в одном сегменте
+    Segment* FindSealedSegment(int document_id) {
+        for (Segment& segment : sealed_segments_) {
+            if (segment.server->HasDocument(document_id) && segment.deleted_ids.count(document_id) == 0) {
+                return &segment;
+            }
+        }
+        return nullptr;
+    }
+
+    void SealMutableSegment() {
+        sealed_segments_.push_back({make_shared<const SearchServer>(mutable_segment_), {}});
+        mutable_segment_ = SearchServer(stop_words_text_);
+        merge_condition_.notify_all();
+    }
+
+    // Уровень 0 - сегменты меньше segment_capacity_ * MERGE_FACTOR документов, каждый
+    // следующий уровень в MERGE_FACTOR раз больше. Сливаются MERGE_FACTOR сегментов нижнего
+    // уровня, где их набралось столько; сегмент, в котором удалено больше половины,
+    // переписывается в первую очередь
+    vector<size_t> FindMergeCandidates() const {
+        for (size_t i = 0; i < sealed_segments_.size(); ++i) {
+            if (sealed_segments_[i].deleted_ids.size() * 2 > static_cast<size_t>(sealed_segments_[i].server->GetDocumentCount())) {
+                return {i};
+            }
+        }
+        map<size_t, vector<size_t>> segments_by_tier;
+        for (size_t i = 0; i < sealed_segments_.size(); ++i) {
+            size_t tier = 0;
+            for (size_t bound = segment_capacity_ * MERGE_FACTOR;
+                 static_cast<size_t>(GetLiveDocumentCount(sealed_segments_[i])) >= bound; bound *= MERGE_FACTOR) {
+                ++tier;
+            }
+            vector<size_t>& tier_segments = segments_by_tier[tier];
+            tier_segments.push_back(i);
+            if (tier_segments.size() == MERGE_FACTOR) {
+                return tier_segments;
+            }
+        }
+        return {};
+    }
+
+    // Слияние строится без блокировки; удаления, пришедшие за это время, переносятся
+    // в отметки нового сегмента при его публикации
+    void RunMerges() {
+        unique_lock lock(segments_mutex_);
+        while (true) {
+            // После ошибки слияния следующее ждёт, пока её не заберут Flush или WaitForMerges
+            merge_condition_.wait(lock, [this] {
+                return is_stopping_ || (merge_error_ == nullptr && !FindMergeCandidates().empty());
+            });
+            if (is_stopping_) {
+                return;
+            }
+            vector<Segment> inputs;
+            for (const size_t i : FindMergeCandidates()) {
+                inputs.push_back(sealed_segments_[i]);
+            }
+            is_merging_ = true;
+            lock.unlock();
+
+            // Исключение здесь завершило бы процесс, поэтому оно сохраняется для вызывающих
+            Segment merged_segment;
+            try {
+                LOG_DURATION("SegmentedSearchServer merge"s);
+                SearchServer merged(stop_words_text_);
+                for (const Segment& input : inputs) {
+                    merged.AddDocumentsFrom(*input.server, [&input](int document_id) {
+                        return input.deleted_ids.count(document_id) == 0;
+                    });
+                }
+                merged_segment.server = make_shared<const SearchServer>(move(merged));
+            } catch (...) {
+                lock.lock();
+                merge_error_ = current_exception();
+                is_merging_ = false;
+                merge_condition_.notify_all();
+                continue;
+            }
+
+            lock.lock();
+            // Запечатанные сегменты убирает только этот поток, поэтому входы на месте
+            for (const Segment& input : inputs) {
+                const auto it = find_if(sealed_segments_.begin(), sealed_segments_.end(), [&input](const Segment& segment) {
+                    return segment.server == input.server;
+                });
+                for (const int document_id : it->deleted_ids) {
+                    if (input.deleted_ids.count(document_id) == 0) {
+                        merged_segment.deleted_ids.insert(document_id);
+                    }
+                }
+                sealed_segments_.erase(it);
+            }
+            if (merged_segment.server->GetDocumentCount() > 0) {
+                sealed_segments_.push_back(move(merged_segment));
+            }
+            is_merging_ = false;
+            merge_condition_.notify_all();
+        }
+    }
+
+    // IDF считается так же, как в SearchServer: log(N) - log(df). Удалённые документы
+    // запечатанных сегментов вычитаются и из N, и из df своих слов
+    vector<double> ComputeInverseDocumentFreqs(const Query& query) const {
+        int document_count = mutable_segment_.GetDocumentCount();
+        vector<int> document_freqs(query.plus_words.size());
+        for (size_t word = 0; word < query.plus_words.size(); ++word) {
+            document_freqs[word] = mutable_segment_.GetDocumentFreq(query.plus_words[word]);
+        }
+        for (const Segment& segment : sealed_segments_) {
+            document_count += GetLiveDocumentCount(segment);
+            for (size_t word = 0; word < query.plus_words.size(); ++word) {
+                document_freqs[word] += segment.server->GetDocumentFreq(query.plus_words[word]);
+            }
+            for (const int document_id : segment.deleted_ids) {
+                const map<string_view, double>& word_freqs = segment.server->GetWordFrequencies(document_id);
+                for (size_t word = 0; word < query.plus_words.size(); ++word) {
+                    document_freqs[word] -= static_cast<int>(word_freqs.count(query.plus_words[word]));
+                }
+            }
+        }
+
+        const double log_document_count = document_count == 0 ? 0.0 : log(static_cast<double>(document_count));
+        vector<double> plus_word_idfs(query.plus_words.size(), 0.0);
+        for (size_t word = 0; word < plus_word_idfs.size(); ++word) {
+            if (document_freqs[word] > 0) {
+                plus_word_idfs[word] = log_document_count - log(static_cast<double>(document_freqs[word]));
+            }
+        }
+        return plus_word_idfs;
+    }
+
+    // Вызывается под блокировкой
+    void RethrowMergeError() const {
+        if (merge_error_ != nullptr) {
+            const exception_ptr error = exchange(merge_error_, nullptr);
+            merge_condition_.notify_all();
+            rethrow_exception(error);
+        }
+    }
+
+    const string stop_words_text_;
+    const size_t segment_capacity_;
+    // Пустой сервер с теми же стоп-словами разбирает запросы так же, как сегменты
+    SearchServer query_parser_;
+    // Поиск держит блокировку на чтение, изменения - на запись
+    mutable shared_mutex segments_mutex_;
+    mutable condition_variable_any merge_condition_;
+    SearchServer mutable_segment_;
+    vector<Segment> sealed_segments_;
+    // Ошибка последнего слияния, ещё не выброшенная вызывающему
+    mutable exception_ptr merge_error_;
+    bool is_merging_ = false;
+    bool is_stopping_ = false;
+    thread merge_thread_;
+};
+
+// Сервер для одновременных чтения и записи. Читатели работают с неизменяемой версией
+// индекса и никогда не ждут писателя. Писатель применяет изменения к копии текущей
+// версии и публикует её атомарной заменой указателя. Старая версия освобождается,
+// когда её отпускает последний читатель. Копия стоит O(размер индекса), поэтому каждая
+// запись, даже одного документа, стоит O(размер индекса): при загрузке корпуса документы
+// нужно добавлять пакетами через AddDocuments, а прочие изменения объединять в один Update
+class VersionedSearchServer {
+public:
+    explicit VersionedSearchServer(SearchServer server)
+        : current_(make_shared<const SearchServer>(move(server))) {
+    }
+
+    // Версия остаётся действительной, пока жив указатель, в том числе string_view
+    // из MatchDocument. Для нескольких запросов к одной версии её стоит взять один раз
+    shared_ptr<const SearchServer> GetSnapshot() const {
+        return LoadVersion(current_);
+    }
+
+    // update получает изменяемую копию текущей версии. Писатели выполняются по очереди
+    template <typename Updater>
+    void Update(Updater update) {
+        lock_guard guard(writer_mutex_);
+        auto next = make_shared<SearchServer>(*LoadVersion(current_));
+        update(*next);
+        StoreVersion(current_, move(next));
+    }
+
+    // Весь пакет RawDocument публикуется одной версией за одно копирование индекса
+    template <typename DocumentRange>
+    void AddDocuments(const DocumentRange& documents) {
+        Update([&documents](SearchServer& server) {
+            server.AddDocuments(documents);
+        });
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        Update([&](SearchServer& server) {
+            server.AddDocument(document_id, document, status, ratings);
+        });
+    }
+
+    void RemoveDocument(int document_id) {
+        Update([document_id](SearchServer& server) {
+            server.RemoveDocument(document_id);
+        });
+    }
+
+    template <typename... Args>
+    vector<Document> FindTopDocuments(Args&&... args) const {
+        return GetSnapshot()->FindTopDocuments(forward<Args>(args)...);
+    }
+
+    int GetDocumentCount() const {
+        return GetSnapshot()->GetDocumentCount();
+    }
+
+private:
+    // Свободные atomic_load/atomic_store для shared_ptr устарели в C++20; при переходе
+    // на atomic<shared_ptr> меняются только эти две функции и тип current_
+    static shared_ptr<const SearchServer> LoadVersion(const shared_ptr<const SearchServer>& version) {
+        return atomic_load(&version);
+    }
+
+    static void StoreVersion(shared_ptr<const SearchServer>& version, shared_ptr<const SearchServer> next) {
+        atomic_store(&version, move(next));
+    }
+
+    shared_ptr<const SearchServer> current_;
+    mutex writer_mutex_;
+};
+
+// Кеш результатов FindTopDocuments по статусу. Ключ - разобранный запрос (отсортированные
+// слова без повторов и стоп-слов), статус и число результатов, поэтому запросы, которые
+// различаются только порядком или повтором слов, делят одну запись. Запись помнит поколение
+// индекса, по которому посчитана, и после изменения индекса считается промахом. Кеш разбит
+// на части со своими блокировками и своим LRU-списком: запросы к разным частям не ждут
+// друг друга, а результат промаха считается вне блокировки
+class QueryResultCache {
+public:
+    static constexpr size_t DEFAULT_SHARD_COUNT = 16;
+
+    explicit QueryResultCache(size_t capacity, size_t shard_count = DEFAULT_SHARD_COUNT)
+        : shards_(max<size_t>(1, shard_count)) {
+        if (capacity == 0) {
+            throw invalid_argument("Ёмкость кеша должна быть положительной");
+        }
+        shard_capacity_ = max<size_t>(1, capacity / shards_.size());
+    }
+
+    vector<Document> FindTopDocuments(const SearchServer& server, string_view raw_query,
+                                      DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) {
+        return FindTopDocuments(server, server.ParseQuery(raw_query), status, max_result_count);
+    }
+
+    vector<Document> FindTopDocuments(const SearchServer& server, const SearchServer::Query& query,
+                                      DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) {
+        string key = MakeKey(query, status, max_result_count);
+        Shard& shard = shards_[hash<string>{}(key) % shards_.size()];
+        const uint64_t generation = server.GetGeneration();
+        {
+            lock_guard guard(shard.entries_mutex);
+            const auto it = shard.entries.find(key);
+            if (it != shard.entries.end() && it->second.generation == generation) {
+                shard.usage_order.splice(shard.usage_order.begin(), shard.usage_order, it->second.usage_position);
+                hit_count_.fetch_add(1, memory_order_relaxed);
+                return it->second.documents;
+            }
+        }
+        miss_count_.fetch_add(1, memory_order_relaxed);
+        vector<Document> documents = server.FindTopDocuments(query, status, max_result_count);
+
+        lock_guard guard(shard.entries_mutex);
+        auto [it, is_inserted] = shard.entries.try_emplace(move(key));
+        if (is_inserted) {
+            shard.usage_order.push_front(&it->first);
+            it->second.usage_position = shard.usage_order.begin();
+            if (shard.entries.size() > shard_capacity_) {
+                shard.entries.erase(*shard.usage_order.back());
+                shard.usage_order.pop_back();
+            }
+        } else {
+            shard.usage_order.splice(shard.usage_order.begin(), shard.usage_order, it->second.usage_position);
+        }
+        it->second.generation = generation;
+        it->second.documents = documents;
+        return documents;
+    }
+
+    uint64_t GetHitCount() const {
+        return hit_count_.load(memory_order_relaxed);
+    }
+
+    uint64_t GetMissCount() const {
+        return miss_count_.load(memory_order_relaxed);
+    }
+
+    void Clear() {
+        for (Shard& shard : shards_) {
+            lock_guard guard(shard.entries_mutex);
+            shard.entries.clear();
+            shard.usage_order.clear();
+        }
+    }
+
+private:
+    struct Entry {
+        uint64_t generation = 0;
+        vector<Document> documents;
+        list<const string*>::iterator usage_position;
+    };
+
+    struct Shard {
+        mutex entries_mutex;
+        unordered_map<string, Entry> entries;
+        // Ключи записей от недавно использованных к давно использованным; указывают
+        // на ключи в entries, которые не двигаются при перехешировании
+        list<const string*> usage_order;
+    };
+
+    // Слова не содержат управляющих символов, поэтому разделители однозначны
+    static string MakeKey(const SearchServer::Query& query, DocumentStatus status, size_t max_result_count) {
+        string key;
+        for (const string_view word : query.plus_words) {
+            key.append(word);
+            key.push_back('\x01');
+        }
+        key.push_back('\x02');
+        for (const string_view word : query.minus_words) {
+            key.append(word);
+            key.push_back('\x01');
+        }
+        key.push_back('\x02');
+        // Фраза - её слова и допустимый промежуток, минус-фразы отделены от фраз
+        for (const auto* phrases : {&query.phrases, &query.minus_phrases}) {
+            for (const QueryPhrase& phrase : *phrases) {
+                for (const string_view word : phrase.words) {
+                    key.append(word);
+                    key.push_back('\x01');
+                }
+                key.append(to_string(phrase.max_gap));
+                key.push_back('\x03');
+            }
+            key.push_back('\x02');
+        }
+        const uint64_t parameters[] = {static_cast<uint64_t>(status), max_result_count};
+        key.append(reinterpret_cast<const char*>(parameters), sizeof(parameters));
+        return key;
+    }
+
+    vector<Shard> shards_;
+    size_t shard_capacity_;
+    atomic<uint64_t> hit_count_{0};
+    atomic<uint64_t> miss_count_{0};
+};
+
+// Очередь последних запросов к серверу: каждый запрос занимает одну минуту, хранятся
+// запросы за последние сутки. Число запросов без результатов ведётся при записи, поэтому
+// GetNoResultRequests не просматривает историю
+class RequestQueue {
+public:
+    explicit RequestQueue(const SearchServer& search_server)
+        : search_server_(search_server) {
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> AddFindRequest(string_view raw_query, DocumentPredicate document_predicate) {
+        vector<Document> result = search_server_.FindTopDocuments(raw_query, document_predicate);
+        AddRequest(result.empty());
+        return result;
+    }
+
+    vector<Document> AddFindRequest(string_view raw_query, DocumentStatus status) {
+        vector<Document> result = search_server_.FindTopDocuments(raw_query, status);
+        AddRequest(result.empty());
+        return result;
+    }
+
+    vector<Document> AddFindRequest(string_view raw_query) {
+        vector<Document> result = search_server_.FindTopDocuments(raw_query);
+        AddRequest(result.empty());
+        return result;
+    }
+
+    int GetNoResultRequests() const {
+        return no_result_count_;
+    }
+
+private:
+    static constexpr size_t MIN_IN_DAY = 1440;
+
+    // Новый запрос занимает место самого старого, когда окно заполнено
+    void AddRequest(bool is_empty) {
+        if (request_count_ == MIN_IN_DAY) {
+            no_result_count_ -= is_empty_[next_slot_];
+        } else {
+            ++request_count_;
+        }
+        is_empty_[next_slot_] = is_empty;
+        no_result_count_ += is_empty;
+        next_slot_ = (next_slot_ + 1) % MIN_IN_DAY;
+    }
+
+    const SearchServer& search_server_;
+    array<bool, MIN_IN_DAY> is_empty_{};
+    size_t next_slot_ = 0;
+    size_t request_count_ = 0;
+    int no_result_count_ = 0;
+};
+
+// Хеш набора слов документа; слова прямого индекса уже отсортированы
+struct WordSetHasher {
+    size_t operator()(const vector<string_view>& words) const {
+        size_t result = words.size();
+        for (const string_view word : words) {
+            result = result * 37 + hash<string_view>{}(word);
+        }
+        return result;
+    }
+};
+
+// Удаляет документы с тем же набором слов (без учёта стоп-слов и частот), что и у
+// документа с меньшим id. Наборы сравниваются через хеш-таблицу, а не попарно.
+// Возвращает id удалённых документов по возрастанию
+vector<int> RemoveDuplicates(SearchServer& search_server) {
+    vector<int> document_ids(search_server.GetDocumentCount());
+    for (int index = 0; index < search_server.GetDocumentCount(); ++index) {
+        document_ids[index] = search_server.GetDocumentId(index);
+    }
+    sort(document_ids.begin(), document_ids.end());
+
+    unordered_set<vector<string_view>, WordSetHasher> seen_word_sets;
+    vector<int> duplicate_ids;
+    for (const int document_id : document_ids) {
+        const auto& word_freqs = search_server.GetWordFrequencies(document_id);
+        vector<string_view> words;
+        words.reserve(word_freqs.size());
+        for (const auto& [word, _] : word_freqs) {
+            words.push_back(word);
+        }
+        if (!seen_word_sets.insert(move(words)).second) {
+            duplicate_ids.push_back(document_id);
+        }
+    }
+    for (const int document_id : duplicate_ids) {
+        search_server.RemoveDocument(document_id);
+    }
+    return duplicate_ids;
+}
+
+// Выполняет пакет запросов параллельно, результат i-го запроса лежит в i-й ячейке
+vector<vector<Document>> ProcessQueries(const SearchServer& search_server, const vector<string>& queries) {
+    vector<vector<Document>> documents_lists(queries.size());
+    ForEachIndexParallel(queries.size(), [&](size_t i) {
+        documents_lists[i] = search_server.FindTopDocuments(queries[i]);
+    });
+    return documents_lists;
+}
+
+// То же, что ProcessQueries, но результаты всех запросов идут подряд в одном векторе.
+// Каждый запрос пишет не больше max_result_count документов прямо в свой участок общего
+// вектора, после чего участки сдвигаются друг к другу за один проход
+vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const vector<string>& queries,
+                                      size_t max_result_count = MAX_RESULT_DOCUMENT_COUNT) {
+    vector<Document> documents(queries.size() * max_result_count);
+    vector<size_t> counts(queries.size());
+    ForEachIndexParallel(queries.size(), [&](size_t i) {
+        const auto slot = documents.begin() + i * max_result_count;
+        counts[i] = search_server.WriteTopDocuments(queries[i], DocumentStatus::ACTUAL, max_result_count, slot) - slot;
+    });
+
+    auto output = documents.begin();
+    for (size_t i = 0; i < counts.size(); ++i) {
+        const auto slot = documents.begin() + i * max_result_count;
+        output = move(slot, slot + counts[i], output);
+    }
+    documents.erase(output, documents.end());
+    return documents;
+}
+
+// Распределение Ципфа на рангах [0, n): вероятность ранга r пропорциональна 1 / (r + 1)^exponent
+class ZipfDistribution {
+public:
+    ZipfDistribution(size_t rank_count, double exponent) {
+        if (rank_count == 0 || exponent < 0) {
+            throw invalid_argument("Распределение Ципфа требует хотя бы один ранг и неотрицательный показатель");
+        }
+        cumulative_weights_.reserve(rank_count);
+        double weight_sum = 0;
+        for (size_t rank = 0; rank < rank_count; ++rank) {
+            weight_sum += pow(static_cast<double>(rank + 1), -exponent);
+            cumulative_weights_.push_back(weight_sum);
+        }
+    }
+
+    template <typename Generator>
+    size_t operator()(Generator& generator) const {
+        const double point = uniform_real_distribution<double>(0, cumulative_weights_.back())(generator);
+        const auto it = upper_bound(cumulative_weights_.begin(), cumulative_weights_.end(), point);
+        return min<size_t>(it - cumulative_weights_.begin(), cumulative_weights_.size() - 1);
+    }
+
+private:
+    vector<double> cumulative_weights_;
+};
+
+// Параметры синтетического корпуса для бенчмарков
+struct CorpusConfig {
+    size_t vocabulary_size = 20000;
+    double zipf_exponent = 1.0;
+    size_t document_count = 50000;
+    size_t document_length = 40;
+    size_t query_count = 5000;
+    size_t query_length = 4;
+    double minus_word_ratio = 0.1;
+    uint32_t seed = 1;
+};
+
+// Разбирает аргументы вида --name=value; незаданные параметры остаются по умолчанию
+CorpusConfig ParseCorpusConfig(const vector<string_view>& arguments) {
+    CorpusConfig config;
+    for (const string_view argument : arguments) {
+        const size_t separator = argument.find('=');
+        if (argument.substr(0, 2) != "--"sv || separator == argument.npos) {
+            throw invalid_argument("Параметры бенчмарка задаются как --name=value: "s + string(argument));
+        }
+        const string_view name = argument.substr(2, separator - 2);
+        const string value(argument.substr(separator + 1));
+        if (name == "vocabulary"sv) {
+            config.vocabulary_size = stoull(value);
+        } else if (name == "zipf"sv) {
+            config.zipf_exponent = stod(value);
+        } else if (name == "documents"sv) {
+            config.document_count = stoull(value);
+        } else if (name == "document-length"sv) {
+            config.document_length = stoull(value);
+        } else if (name == "queries"sv) {
+            config.query_count = stoull(value);
+        } else if (name == "query-length"sv) {
+            config.query_length = stoull(value);
+        } else if (name == "minus-ratio"sv) {
+            config.minus_word_ratio = stod(value);
+        } else if (name == "seed"sv) {
+            config.seed = static_cast<uint32_t>(stoul(value));
+        } else {
+            throw invalid_argument("Неизвестный параметр бенчмарка: "s + string(name));
+        }
+    }
+    if (config.vocabulary_size == 0 || config.document_length == 0 || config.query_length == 0
+        || config.minus_word_ratio < 0 || config.minus_word_ratio > 1) {
+        throw invalid_argument("Словарь, длины документов и запросов должны быть положительными, доля минус-слов - от 0 до 1");
+    }
+    return config;
+}
+
+// Генератор документов и запросов из словаря случайных слов. Слова выбираются по Ципфу:
+// слово с меньшим номером в словаре встречается чаще. При одном seed результат повторяется
+class CorpusGenerator {
+public:
+    explicit CorpusGenerator(const CorpusConfig& config)
+        : config_(config)
+        , generator_(config.seed)
+        , word_distribution_(config.vocabulary_size, config.zipf_exponent) {
+        unordered_set<string> used_words;
+        uniform_int_distribution<int> length_distribution(3, 10);
+        uniform_int_distribution<int> letter_distribution('a', 'z');
+        while (vocabulary_.size() < config.vocabulary_size) {
+            string word(length_distribution(generator_), ' ');
+            for (char& c : word) {
+                c = static_cast<char>(letter_distribution(generator_));
+            }
+            if (used_words.insert(word).second) {
+                vocabulary_.push_back(move(word));
+            }
+        }
+    }
+
+    const vector<string>& GetVocabulary() const {
+        return vocabulary_;
+    }
+
+    vector<string> GenerateDocuments() {
+        vector<string> documents;
+        documents.reserve(config_.document_count);
+        for (size_t i = 0; i < config_.document_count; ++i) {
+            documents.push_back(GenerateText(config_.document_length, 0));
+        }
+        return documents;
+    }
+
+    vector<string> GenerateQueries() {
+        vector<string> queries;
+        queries.reserve(config_.query_count);
+        for (size_t i = 0; i < config_.query_count; ++i) {
+            queries.push_back(GenerateText(config_.query_length, config_.minus_word_ratio));
+        }
+        return queries;
+    }
+
+private:
+    string GenerateText(size_t word_count, double minus_word_ratio) {
+        bernoulli_distribution is_minus_word(minus_word_ratio);
+        string text;
+        for (size_t i = 0; i < word_count; ++i) {
+            if (i > 0) {
+                text += ' ';
+            }
+            if (is_minus_word(generator_)) {
+                text += '-';
+            }
+            text += vocabulary_[word_distribution_(generator_)];
+        }
+        return text;
+    }
+
+    CorpusConfig config_;
+    mt19937 generator_;
+    ZipfDistribution word_distribution_;
+    vector<string> vocabulary_;
+};
+
+// Параметры потоковой загрузки корпуса
+struct CorpusLoadOptions {
+    // Документов в одном вызове AddDocuments
+    size_t batch_size = 4096;
+    // Размер одного чтения из потока или куска отображённого файла
+    size_t chunk_size = 1 << 20;
+    // Длина очередей между этапами: сколько кусков и пакетов может ждать обработки
+    size_t queue_capacity = 4;
+};
+
+// Потоковая загрузка корпуса в формате TSV: строка "id<TAB>статус<TAB>рейтинги<TAB>текст",
+// статус - число или имя (ACTUAL, IRRELEVANT, BANNED, REMOVED), рейтинги - целые через
+// пробел, возможно ни одного. Пустые строки пропускаются, "\r" в конце строки отбрасывается.
+// Чтение, разбор и добавление в индекс идут на трёх потоках, соединённых очередями
+// ограниченной длины: быстрый этап ждёт медленный, а не копит данные в памяти. Пакеты
+// добавляются через AddDocuments целиком; при ошибке уже добавленные пакеты остаются в индексе
+class CorpusLoader {
+public:
+    CorpusLoader(SearchServer& server, const CorpusLoadOptions& options = {})
+        : server_(server)
+        , options_(options) {
+        if (options_.batch_size == 0 || options_.chunk_size == 0) {
+            throw invalid_argument("Размеры пакета и куска чтения должны быть положительными");
+        }
+    }
+
+    // Возвращает число добавленных документов
+    size_t Load(istream& input) {
+        return Run([this, &input](BoundedQueue<Chunk>& chunks) {
+            ReadStream(input, chunks);
+        });
+    }
+
+    // Файл отображается в память, куски ссылаются на отображение без копирования
+    size_t LoadFile(const string& path) {
+        ifstream probe(path, ios::binary | ios::ate);
+        if (!probe) {
+            throw runtime_error("Не удалось открыть файл: "s + path);
+        }
+        if (probe.tellg() == 0) {
+            return 0;
+        }
+        probe.close();
+        const auto file = make_shared<const MappedFile>(path);
+        return Run([this, &file](BoundedQueue<Chunk>& chunks) {
+            SplitMappedFile(file, chunks);
+        });
+    }
+
+private:
+    // Кусок из целых строк; owner держит память, на которую указывает text
+    struct Chunk {
+        shared_ptr<const void> owner;
+        string_view text;
+    };
+
+    // Тексты документов пакета указывают в куски из owners
+    struct Batch {
+        vector<shared_ptr<const void>> owners;
+        vector<RawDocument> documents;
+    };
+
+    template <typename Reader>
+    size_t Run(Reader read_chunks) {
+        BoundedQueue<Chunk> chunks(options_.queue_capacity);
+        BoundedQueue<Batch> batches(options_.queue_capacity);
+        exception_ptr reader_error;
+        exception_ptr parser_error;
+        thread reader([&] {
+            try {
+                read_chunks(chunks);
+            } catch (...) {
+                reader_error = current_exception();
+                batches.Cancel();
+            }
+            chunks.Close();
+        });
+        thread parser([&] {
+            try {
+                ParseChunks(chunks, batches);
+            } catch (...) {
+                parser_error = current_exception();
+                chunks.Cancel();
+            }
+            batches.Close();
+        });
+
+        size_t document_count = 0;
+        exception_ptr indexer_error;
+        try {
+            while (optional<Batch> batch = batches.Pop()) {
+                server_.AddDocuments(execution::par, batch->documents);
+                document_count += batch->documents.size();
+            }
+        } catch (...) {
+            indexer_error = current_exception();
+            batches.Cancel();
+            chunks.Cancel();
+        }
+        reader.join();
+        parser.join();
+        for (const exception_ptr& error : {indexer_error, parser_error, reader_error}) {
+            if (error) {
+                rethrow_exception(error);
+            }
+        }
+        return document_count;
+    }
+
+    // Кусок заканчивается на последнем переводе строки, остаток переходит в следующий
+    void ReadStream(istream& input, BoundedQueue<Chunk>& chunks) const {
+        string carry;
+        while (true) {
+            auto buffer = make_shared<string>(move(carry));
+            const size_t carried = buffer->size();
+            buffer->resize(carried + options_.chunk_size);
+            input.read(buffer->data() + carried, static_cast<streamsize>(options_.chunk_size));
+            buffer->resize(carried + static_cast<size_t>(input.gcount()));
+            if (input.bad()) {
+                throw runtime_error("Ошибка чтения корпуса");
+            }
+            const bool is_last = !input;
+            size_t end = buffer->size();
+            carry.clear();
+            if (!is_last) {
+                const size_t newline = buffer->rfind('\n');
+                end = newline == string::npos ? 0 : newline + 1;
+                carry.assign(*buffer, end, string::npos);
+            }
+            if (end > 0) {
+                const string_view text(buffer->data(), end);
+                if (!chunks.Push({move(buffer), text})) {
+                    return;
+                }
+            }
+            if (is_last) {
+                return;
+            }
+        }
+    }
+
+    void SplitMappedFile(const shared_ptr<const MappedFile>& file, BoundedQueue<Chunk>& chunks) const {
+        string_view rest(file->GetData(), file->GetSize());
+        while (!rest.empty()) {
+            size_t end = rest.size();
+            if (rest.size() > options_.chunk_size) {
+                const size_t newline = rest.find('\n', options_.chunk_size - 1);
+                end = newline == string_view::npos ? rest.size() : newline + 1;
+            }
+            if (!chunks.Push({file, rest.substr(0, end)})) {
+                return;
+            }
+            rest.remove_prefix(end);
+        }
+    }
+
+    void ParseChunks(BoundedQueue<Chunk>& chunks, BoundedQueue<Batch>& batches) const {
+        Batch batch;
+        size_t line_number = 0;
+        while (optional<Chunk> chunk = chunks.Pop()) {
+            batch.owners.push_back(chunk->owner);
+            string_view text = chunk->text;
+            while (!text.empty()) {
+                const size_t newline = text.find('\n');
+                string_view line = text.substr(0, newline);
+                text.remove_prefix(newline == string_view::npos ? text.size() : newline + 1);
+                ++line_number;
+                if (!line.empty() && line.back() == '\r') {
+                    line.remove_suffix(1);
+                }
+                if (line.empty()) {
+                    continue;
+                }
+                batch.documents.push_back(ParseLine(line, line_number));
+                if (batch.documents.size() == options_.batch_size) {
+                    // Последний кусок может понадобиться следующему пакету
+                    shared_ptr<const void> current_owner = batch.owners.back();
+                    if (!batches.Push(move(batch))) {
+                        return;
+                    }
+                    batch = Batch{};
+                    batch.owners.push_back(move(current_owner));
+                }
+            }
+        }
+        if (!batch.documents.empty()) {
+            batches.Push(move(batch));
+        }
+    }
+
+    static RawDocument ParseLine(string_view line, size_t line_number) {
+        string_view fields[3];
+        for (string_view& field : fields) {
+            const size_t tab = line.find('\t');
+            if (tab == string_view::npos) {
+                throw invalid_argument("Строка "s + to_string(line_number) + " корпуса: нужно четыре поля через табуляцию"s);
+            }
+            field = line.substr(0, tab);
+            line.remove_prefix(tab + 1);
+        }
+        RawDocument document{0, line, DocumentStatus::ACTUAL, {}};
+        if (!ParseInteger(fields[0], document.id)) {
+            throw invalid_argument("Строка "s + to_string(line_number) + " корпуса: неверный id"s);
+        }
+        if (!ParseStatus(fields[1], document.status)) {
+            throw invalid_argument("Строка "s + to_string(line_number) + " корпуса: неверный статус"s);
+        }
+        for (const string_view rating : SplitIntoWords(fields[2])) {
+            if (!ParseInteger(rating, document.ratings.emplace_back())) {
+                throw invalid_argument("Строка "s + to_string(line_number) + " корпуса: неверный рейтинг"s);
+            }
+        }
+        return document;
+    }
+
+    static bool ParseInteger(string_view text, int& value) {
+        const auto [end, error] = from_chars(text.data(), text.data() + text.size(), value);
+        return error == errc{} && end == text.data() + text.size() && !text.empty();
+    }
+
+    static bool ParseStatus(string_view text, DocumentStatus& status) {
+        static constexpr string_view names[DOCUMENT_STATUS_COUNT] = {"ACTUAL"sv, "IRRELEVANT"sv, "BANNED"sv, "REMOVED"sv};
+        for (size_t i = 0; i < DOCUMENT_STATUS_COUNT; ++i) {
+            if (text == names[i]) {
+                status = static_cast<DocumentStatus>(i);
+                return true;
+            }
+        }
+        int number = 0;
+        if (!ParseInteger(text, number) || number < 0 || number >= static_cast<int>(DOCUMENT_STATUS_COUNT)) {
+            return false;
+        }
+        status = static_cast<DocumentStatus>(number);
+        return true;
+    }
+
+    SearchServer& server_;
+    CorpusLoadOptions options_;
+};
+
+void AssertImpl(bool value, const string& expr_str, const string& file, const string& func, unsigned line,
+                const string& hint) {
+    if (!value) {
+        cout << file << "("s << line << "): "s << func << ": "s;
+        cout << "ASSERT("s << expr_str << ") failed."s;
+        if (!hint.empty()) {
+            cout << " Hint: "s << hint;
+        }
+        cout << endl;
+        abort();
+    }
+}
+
+template <typename T, typename U>
+void AssertEqualImpl(const T& t, const U& u, const string& t_str, const string& u_str, const string& file,
+                     const string& func, unsigned line, const string& hint) {
+    if (t != u) {
+        cout << boolalpha;
+        cout << file << "("s << line << "): "s << func << ": "s;
+        cout << "ASSERT_EQUAL("s << t_str << ", "s << u_str << ") failed: "s;
+        cout << t << " != "s << u << "."s;
+        if (!hint.empty()) {
+            cout << " Hint: "s << hint;
+        }
+        cout << endl;
+        abort();
+    }
+}
+
+template <typename TestType>
+void RunTest(const TestType& test, const string& test_name) {
+    test();
+    cerr << test_name << " OK" << endl;
+}
+
+void TestDocumentAddition () {
+    const string content = "content"s;
+    const vector<int> ratings = {0};
+    {
+    SearchServer server;
+    server.AddDocument(0, content, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, content, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, content, DocumentStatus::ACTUAL, ratings);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("content"s).size(), 3, "Must have 3 documnets");
+    ASSERT_HINT(server.FindTopDocuments("cat"s).empty(), "Must have no results");
+    }
+}
+
+
+// Тест проверяет, что поисковая система исключает стоп-слова при добавлении документов
+void TestExcludeStopWordsFromAddedDocumentContent() {
+    const int doc_id = 42;
+    const string content = "cat in the city"s;
+    const vector<int> ratings = {1, 2, 3};
+    // Сначала убеждаемся, что поиск слова, не входящего в список стоп-слов,
+    // находит нужный документ
+    {
+        SearchServer server;
+        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
+        const auto found_docs = server.FindTopDocuments("in"s);
+        ASSERT_EQUAL_HINT(found_docs.size(), 1, "Must have no results");
+        const Document& doc0 = found_docs[0];
+        ASSERT_EQUAL_HINT(doc0.id, doc_id, "Document ID must be 42");
+    }
+
+    // Затем убеждаемся, что поиск этого же слова, входящего в список стоп-слов,
+    // возвращает пустой результат
+    {
+        SearchServer server("in the"s);
+        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
+        ASSERT_HINT(server.FindTopDocuments("in"s).empty(), "Must be empty");
+    }
+}
+
+void TestMinusWordAddition () {
+    SearchServer server;
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "cat with fur"s, DocumentStatus::ACTUAL, ratings);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat").size(), 1, "Must have 1 result");
+    ASSERT_HINT(server.FindTopDocuments("cat -fur").empty(), "Must be empty");
+}
+
+void TestDocumentMatching() {
+    SearchServer server;
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "cat with fur"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "cat with hat"s, DocumentStatus::ACTUAL, ratings);
+    const auto answer = server.MatchDocument("cat fur"s, 0);
+    ASSERT_HINT((get<0>(answer)[0] == "cat"s && get<0>(answer)[1] == "fur"s && get<0>(answer).size() == 2), "Must have 2 elements in the vector");
+    const auto answer_empty = server.MatchDocument("cat -hat"s, 1);
+    ASSERT_HINT(get<0>(answer_empty).empty(), "Must be empty");
+}
+
+void TestRelevanceSorting() {
+    SearchServer server("и в на"s);
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, ratings);
+    const auto found_docs = server.FindTopDocuments("пушистый ухоженный кот"s);
+    ASSERT_HINT((found_docs[0].relevance > found_docs[1].relevance && found_docs[1].relevance > found_docs[2].relevance), "Relevance sorting must go highest to lowest");
+}
+
+void TestRatingCounting () {
+    SearchServer server;
+    const vector<int> ratings = {2, 61, 42};
+    server.AddDocument(0, "белый кот"s, DocumentStatus::ACTUAL, ratings);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("белый кот"s)[0].rating, 35, "Document ID must be 35");
+}
+
+void TestRelevanceCounting () {
+    SearchServer server("и в на"s);
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, ratings);
+    const auto found_docs = server.FindTopDocuments("пушистый ухоженный кот"s);
+    ASSERT_HINT((round(found_docs[0].relevance * 1000000) == 650672 && round(found_docs[1].relevance * 1000000) == 274653 && round(found_docs[2].relevance * 1000000) == 101366), "Relevance must be calculated correctly");
+}
+
+void TestKeyMapperSort() {
+    SearchServer server;
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "dog"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "dog"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "dog"s, DocumentStatus::REMOVED, ratings);
+    server.AddDocument(3, "dog"s, DocumentStatus::BANNED, ratings);
+    {
+    const auto found_docs = server.FindTopDocuments("dog"s, [] (
+    [[maybe_unused]]const int& doc_id, [[maybe_unused]]const DocumentStatus& doc_status, [[maybe_unused]]const int& rating
+    ) {
+        return doc_id % 2 == 0 && doc_status == DocumentStatus::REMOVED;
+    });
+    ASSERT_EQUAL_HINT(found_docs[0].id, 2, "Document ID must be 2");
+    }
+    {
+    const auto found_docs = server.FindTopDocuments("dog"s, [] (
+    [[maybe_unused]]const int& doc_id, [[maybe_unused]]const DocumentStatus& doc_status, [[maybe_unused]]const int& rating
+    ) {
+        return doc_id % 2 == 0 && doc_status != DocumentStatus::REMOVED;
+    });
+    ASSERT_EQUAL_HINT(found_docs[0].id, 0, "Document ID must be 0");
+    }
+        {
+    const auto found_docs = server.FindTopDocuments("dog"s, [] (
+    [[maybe_unused]]const int& doc_id, [[maybe_unused]]const DocumentStatus& doc_status, [[maybe_unused]]const int& rating
+    ) {
+        return doc_id % 2 == 0 && doc_status == DocumentStatus::BANNED;
+    });
+    ASSERT_HINT(found_docs.empty(), "Must be empty");
+    }
+}
+
+void TestDocumentStatus () {
+    SearchServer server;
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "dog"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "dog"s, DocumentStatus::IRRELEVANT, ratings);
+    server.AddDocument(2, "dog"s, DocumentStatus::REMOVED, ratings);
+    server.AddDocument(3, "dog"s, DocumentStatus::BANNED, ratings);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::ACTUAL)[0].id, 0, "Document ID must be 0");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::IRRELEVANT)[0].id,1, "Document ID must be 1");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::REMOVED)[0].id, 2, "Document ID must be 2");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::BANNED)[0].id, 3, "Document ID must be 3");
+}
+
+void TestPostingsOutOfOrderIds() {
+    SearchServer server;
+    const vector<int> ratings = {0};
+    server.AddDocument(7, "cat dog"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "cat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(5, "dog"s, DocumentStatus::ACTUAL, ratings);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s).size(), 2, "Must find documents added with decreasing ids");
+    ASSERT_EQUAL_HINT(get<0>(server.MatchDocument("cat dog"s, 2)).size(), 1, "Document 2 must match only cat");
+    ASSERT_EQUAL_HINT(get<0>(server.MatchDocument("cat dog"s, 7)).size(), 2, "Document 7 must match both words");
+    ASSERT_HINT(get<0>(server.MatchDocument("cat -dog"s, 5)).empty(), "Minus word must exclude document 5");
+}
+
+void TestParallelFindTopDocuments() {
+    SearchServer server("и в на"s);
+    server.AddDocument(0, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, {8, -3});
+    server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    server.AddDocument(2, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, {5, -12, 2, 1});
+    server.AddDocument(3, "ухоженный скворец евгений"s, DocumentStatus::BANNED, {9});
+    const string query = "пушистый ухоженный кот -ошейник"s;
+    for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+        const auto seq_docs = server.FindTopDocuments(execution::seq, query, status);
+        const auto par_docs = server.FindTopDocuments(execution::par, query, status);
+        ASSERT_EQUAL_HINT(seq_docs.size(), par_docs.size(), "Parallel search must find the same documents");
+        for (size_t i = 0; i < seq_docs.size(); ++i) {
+            ASSERT_EQUAL_HINT(seq_docs[i].id, par_docs[i].id, "Parallel search must keep the same order");
+            ASSERT_HINT(abs(seq_docs[i].relevance - par_docs[i].relevance) < 1e-6, "Parallel relevance must match");
+        }
+    }
+    ASSERT_EQUAL_HINT(server.FindTopDocuments(execution::par, query).size(), 2, "Minus word must exclude document 0");
+}
+
+void TestProcessQueries() {
+    SearchServer server("and with"s);
+    const vector<int> ratings = {1, 2};
+    server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(3, "funny pet and not very nasty rat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(4, "pet with rat and rat and rat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(5, "nasty rat with curly hair"s, DocumentStatus::ACTUAL, ratings);
+    const vector<string> queries = {"nasty rat -not"s, "not very funny nasty pet"s, "curly hair"s, "dog"s};
+
+    const auto documents_lists = ProcessQueries(server, queries);
+    ASSERT_EQUAL_HINT(documents_lists.size(), queries.size(), "Must return one result list per query");
+    size_t total = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const auto expected = server.FindTopDocuments(queries[i]);
+        ASSERT_EQUAL_HINT(documents_lists[i].size(), expected.size(), "Batch result must match single query");
+        total += expected.size();
+    }
+    ASSERT_HINT(documents_lists[3].empty(), "Unknown word must give no results");
+
+    const auto joined = ProcessQueriesJoined(server, queries);
+    ASSERT_EQUAL_HINT(joined.size(), total, "Joined result must contain every found document");
+    size_t position = 0;
+    for (const auto& documents : documents_lists) {
+        for (const Document& document : documents) {
+            ASSERT_EQUAL_HINT(joined[position++].id, document.id, "Joined result must keep query order");
+        }
+    }
+    const auto joined_top = ProcessQueriesJoined(server, queries, 1);
+    ASSERT_EQUAL_HINT(joined_top.size(), 3u, "Joined result must keep at most max_result_count per query");
+    ASSERT_EQUAL_HINT(joined_top[2].id, documents_lists[2][0].id, "Joined slots must be compacted in query order");
+
+    // Ошибка одного запроса пакета выбрасывается вызывающему, а не завершает программу
+    bool is_thrown = false;
+    try {
+        ProcessQueries(server, {"curly"s, "curly --hair"s});
+    } catch (const invalid_argument&) {
+        is_thrown = true;
+    }
+    ASSERT_HINT(is_thrown, "Malformed query in a batch must be reported");
+}
+
+void TestTopDocumentsLimit() {
+    SearchServer server;
+    for (int id = 0; id < 20; ++id) {
+        const string text = id % 2 == 0 ? "dog"s : "dog cat"s;
+        server.AddDocument(id, text, DocumentStatus::ACTUAL, {id});
+    }
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s).size(), MAX_RESULT_DOCUMENT_COUNT, "Default limit must be used");
+    const auto found_docs = server.FindTopDocuments("dog"s, DocumentStatus::ACTUAL, 12);
+    ASSERT_EQUAL_HINT(found_docs.size(), 12, "Limit passed per call must be used");
+    for (size_t i = 1; i < found_docs.size(); ++i) {
+        ASSERT_HINT(!IsMoreRelevant(found_docs[i], found_docs[i - 1]), "Documents must stay in relevance order");
+    }
+    // dog есть во всех документах, IDF равен нулю, и порядок определяет рейтинг
+    ASSERT_EQUAL_HINT(found_docs[0].id, 19, "Best document must come first");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments(execution::par, "dog"s, DocumentStatus::ACTUAL, 30).size(), 20,
+                      "Limit larger than result must return every document");
+}
+
+void TestStringViewTokenization() {
+    const vector<string_view> words = SplitIntoWords("  cat  with   fur "sv);
+    ASSERT_EQUAL_HINT(words.size(), 3, "Repeated spaces must not produce empty words");
+    ASSERT_HINT(words[0] == "cat"sv && words[1] == "with"sv && words[2] == "fur"sv, "Words must keep their order");
+
+    SearchServer server(vector<string_view>{"with"sv});
+    {
+        // Сервер хранит собственную копию слов и не ссылается на текст документа после добавления
+        string text = "cat with fur"s;
+        server.AddDocument(1, text, DocumentStatus::ACTUAL, {1});
+        text.assign(text.size(), 'x');
+    }
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("fur"s).size(), 1, "Indexed word must survive the source buffer");
+    ASSERT_HINT(server.FindTopDocuments("with"sv).empty(), "Stop word from string_view container must be ignored");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat cat -dog"sv).size(), 1, "Repeated query words must be handled");
+}
+
+void TestPreparsedQuery() {
+    SearchServer server("in the"s);
+    const vector<int> ratings = {1};
+    server.AddDocument(0, "cat in the city"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "dog in the city"s, DocumentStatus::ACTUAL, ratings);
+    const string raw_query = "city cat city -dog the"s;
+    const SearchServer::Query query = server.ParseQuery(raw_query);
+    ASSERT_EQUAL_HINT(query.plus_words.size(), 2, "Plus words must be deduplicated and stop words dropped");
+    ASSERT_EQUAL_HINT(query.minus_words.size(), 1, "Minus word must be parsed");
+
+    const auto found_docs = server.FindTopDocuments(query);
+    ASSERT_EQUAL_HINT(found_docs.size(), 1, "Minus word must exclude document 1");
+    ASSERT_EQUAL_HINT(found_docs[0].id, server.FindTopDocuments(raw_query)[0].id, "Parsed and raw query must agree");
+    ASSERT_EQUAL_HINT(get<0>(server.MatchDocument(query, 0)).size(), 2, "Document 0 must match both plus words");
+    ASSERT_HINT(get<0>(server.MatchDocument(query, 1)).empty(), "Document 1 must be excluded");
+
+    bool thrown = false;
+    try {
+        server.ParseQuery("cat --dog"s);
+    } catch (const invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT_HINT(thrown, "Invalid query must be rejected while parsing");
+}
+
+void TestParallelMatchDocument() {
+    SearchServer server("and with"s);
+    const vector<int> ratings = {1, 2};
+    server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::BANNED, ratings);
+    const string query = "curly and funny -not curly"s;
+    {
+        const auto [words, status] = server.MatchDocument(execution::par, query, 2);
+        ASSERT_EQUAL_HINT(words.size(), 2, "Repeated plus word must be matched once");
+        ASSERT_HINT(words[0] == "curly"sv && words[1] == "funny"sv, "Matched words must be sorted");
+        ASSERT_HINT(status == DocumentStatus::BANNED, "Document status must be returned");
+    }
+    {
+        const auto [words, status] = server.MatchDocument(execution::par, "funny -rat"s, 1);
+        ASSERT_HINT(words.empty(), "Minus word must clear the match");
+    }
+    {
+        string raw_query = "nasty rat"s;
+        auto [words, status] = server.MatchDocument(execution::seq, raw_query, 1);
+        raw_query.assign(raw_query.size(), 'x');
+        ASSERT_HINT(words.size() == 2 && words[0] == "nasty"sv && words[1] == "rat"sv,
+                    "Matched words must refer to the index, not to the query text");
+    }
+}
+
+void TestRemoveDocument() {
+    SearchServer server("and with"s);
+    const vector<int> ratings = {1, 2};
+    server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(3, "nasty rat with curly hair"s, DocumentStatus::ACTUAL, ratings);
+
+    const auto& word_freqs = server.GetWordFrequencies(2);
+    ASSERT_EQUAL_HINT(word_freqs.size(), 4, "Stop words must not be in the forward index");
+    ASSERT_HINT(abs(word_freqs.at("curly"sv) - 0.25) < 1e-6, "Word frequency must be stored");
+    ASSERT_HINT(server.GetWordFrequencies(42).empty(), "Unknown document must have no words");
+
+    server.RemoveDocument(2);
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 2, "Document count must decrease");
+    ASSERT_EQUAL_HINT(server.GetDocumentId(1), 3, "Removed id must leave the document list");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("curly"s).size(), 1, "Removed document must not be found");
+    ASSERT_HINT(server.GetWordFrequencies(2).empty(), "Removed document must have no words");
+    server.RemoveDocument(2);
+
+    server.RemoveDocument(execution::par, 3);
+    ASSERT_HINT(server.FindTopDocuments("curly hair"s).empty(), "Words of removed documents must not be found");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("funny"s)[0].id, 1, "Remaining document must be found");
+
+    server.AddDocument(2, "curly pet"s, DocumentStatus::ACTUAL, ratings);
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("curly"s).size(), 1, "Removed id may be added again");
+}
+
+void TestRemoveDuplicates() {
+    SearchServer server("and with"s);
+    const vector<int> ratings = {1, 2};
+    server.AddDocument(5, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, ratings);
+    // Отличается только стоп-словами и повторами
+    server.AddDocument(3, "funny funny pet with curly hair and curly"s, DocumentStatus::ACTUAL, ratings);
+    // Тот же набор слов в другом порядке
+    server.AddDocument(4, "rat nasty pet funny"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "funny pet curly"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(6, "nasty rat with curly hair"s, DocumentStatus::ACTUAL, ratings);
+
+    const vector<int> removed = RemoveDuplicates(server);
+    ASSERT_EQUAL_HINT(removed.size(), 2, "Two duplicates must be removed");
+    ASSERT_HINT(removed[0] == 3 && removed[1] == 5, "Duplicates with larger ids must be removed");
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 4, "Unique documents must stay");
+    ASSERT_HINT(RemoveDuplicates(server).empty(), "Second pass must find nothing");
+}
+
+void TestInverseDocumentFreqUpdates() {
+    SearchServer server;
+    const vector<int> ratings = {0};
+    server.AddDocument(0, "cat"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(1, "cat dog"s, DocumentStatus::ACTUAL, ratings);
+    ASSERT_HINT(abs(server.FindTopDocuments("dog"s)[0].relevance - 0.5 * log(2.0)) < 1e-6, "IDF must use current counts");
+
+    server.AddDocument(2, "bird"s, DocumentStatus::ACTUAL, ratings);
+    server.AddDocument(3, "bird dog"s, DocumentStatus::ACTUAL, ratings);
+    ASSERT_HINT(abs(server.FindTopDocuments("dog"s)[0].relevance - 0.5 * log(2.0)) < 1e-6, "IDF must follow N and df");
+    ASSERT_HINT(abs(server.FindTopDocuments("cat"s)[0].relevance - log(2.0)) < 1e-6, "IDF must follow document count");
+
+    server.RemoveDocument(3);
+    ASSERT_HINT(abs(server.FindTopDocuments("dog"s)[0].relevance - 0.5 * log(3.0)) < 1e-6, "IDF must follow removal");
+    server.RemoveDocument(0);
+    server.RemoveDocument(2);
+    ASSERT_HINT(abs(server.FindTopDocuments("dog"s)[0].relevance) < 1e-6, "Word in every document must have zero IDF");
+}
+
+void TestAddDocumentsBatch() {
+    const vector<string> texts = {"funny pet and nasty rat"s, "funny pet with curly hair"s,
+                                  "nasty rat with curly hair"s, "pet with rat and rat and rat"s};
+    SearchServer expected_server("and with"s);
+    SearchServer server("and with"s);
+    server.AddDocument(2, "curly dog"s, DocumentStatus::ACTUAL, {5});
+    expected_server.AddDocument(2, "curly dog"s, DocumentStatus::ACTUAL, {5});
+    vector<RawDocument> batch;
+    for (int i = 0; i < static_cast<int>(texts.size()); ++i) {
+        const int document_id = i * 2 + 1;
+        batch.push_back({document_id, texts[i], DocumentStatus::ACTUAL, {i, 1}});
+        expected_server.AddDocument(document_id, texts[i], DocumentStatus::ACTUAL, {i, 1});
+    }
+    reverse(batch.begin(), batch.end());
+    server.AddDocuments(execution::par, batch);
+
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 5, "Whole batch must be added");
+    ASSERT_EQUAL_HINT(server.GetDocumentId(1), 7, "Document list must keep the batch order");
+    for (const string& query : {"curly rat"s, "funny -nasty"s, "pet"s}) {
+        const auto expected = expected_server.FindTopDocuments(query);
+        const auto found = server.FindTopDocuments(query);
+        ASSERT_EQUAL_HINT(found.size(), expected.size(), "Batch must index like AddDocument");
+        for (size_t i = 0; i < found.size(); ++i) {
+            ASSERT_EQUAL_HINT(found[i].id, expected[i].id, "Batch must rank like AddDocument");
+            ASSERT_HINT(abs(found[i].relevance - expected[i].relevance) < 1e-6, "Batch must score like AddDocument");
+        }
+    }
+    ASSERT_EQUAL_HINT(server.GetWordFrequencies(3).size(), 4, "Forward index must be built");
+
+    const auto count_rejected = [&server](const vector<RawDocument>& documents) {
+        try {
+            server.AddDocuments(documents);
+        } catch (const invalid_argument&) {
+            return 1;
+        }
+        return 0;
+    };
+    ASSERT_EQUAL_HINT(count_rejected({{10, "cat"sv, DocumentStatus::ACTUAL, {}}, {10, "dog"sv, DocumentStatus::ACTUAL, {}}}), 1,
+                      "Duplicate id inside the batch must be rejected");
+    ASSERT_EQUAL_HINT(count_rejected({{11, "cat"sv, DocumentStatus::ACTUAL, {}}, {-1, "dog"sv, DocumentStatus::ACTUAL, {}}}), 1,
+                      "Negative id must be rejected");
+    ASSERT_EQUAL_HINT(count_rejected({{12, "cat"sv, DocumentStatus::ACTUAL, {}}, {3, "dog"sv, DocumentStatus::ACTUAL, {}}}), 1,
+                      "Existing id must be rejected");
+    ASSERT_EQUAL_HINT(count_rejected({{13, "cat"sv, DocumentStatus::ACTUAL, {}}, {14, "d\x12og"sv, DocumentStatus::ACTUAL, {}}}), 1,
+                      "Invalid characters must be rejected");
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 5, "Rejected batch must not change the index");
+    ASSERT_HINT(server.FindTopDocuments("cat"s).empty(), "Rejected batch must not be indexed");
+}
+
+void TestIndexSnapshot() {
+    SearchServer server("and with"s);
+    server.AddDocument(5, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    server.AddDocument(3, "nasty rat with curly hair"s, DocumentStatus::BANNED, {1, 3, 2});
+    server.AddDocument(4, "pet with rat and rat and rat"s, DocumentStatus::ACTUAL, {1, 1, 1});
+    server.AddDocument(9, "dog"s, DocumentStatus::ACTUAL, {1});
+    server.RemoveDocument(9);
+
+    const string path = "search_index_test.snapshot"s;
+    server.SaveIndex(path);
+    {
+        const MappedSearchServer mapped(path);
+        ASSERT_EQUAL_HINT(mapped.GetDocumentCount(), server.GetDocumentCount(), "Snapshot must keep every document");
+        for (int index = 0; index < server.GetDocumentCount(); ++index) {
+            ASSERT_EQUAL_HINT(mapped.GetDocumentId(index), server.GetDocumentId(index), "Snapshot must keep document order");
+        }
+        for (const string& query : {"curly rat"s, "funny -nasty"s, "pet and with"s, "dog"s}) {
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+                const auto expected = server.FindTopDocuments(query, status);
+                const auto found = mapped.FindTopDocuments(query, status);
+                ASSERT_EQUAL_HINT(found.size(), expected.size(), "Snapshot must find the same documents");
+                for (size_t i = 0; i < found.size(); ++i) {
+                    ASSERT_EQUAL_HINT(found[i].id, expected[i].id, "Snapshot must rank like the server");
+                    ASSERT_EQUAL_HINT(found[i].rating, expected[i].rating, "Snapshot must keep ratings");
+                    ASSERT_HINT(abs(found[i].relevance - expected[i].relevance) < 1e-6, "Snapshot must score like the server");
+                }
+            }
+        }
+    }
+    // Номер документа за пределами секции документов
+    {
+        fstream file(path, ios::binary | ios::in | ios::out);
+        SnapshotHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        const uint32_t broken_index = static_cast<uint32_t>(header.document_count);
+        file.seekp(static_cast<streamoff>(header.document_order_offset));
+        file.write(reinterpret_cast<const char*>(&broken_index), sizeof(broken_index));
+    }
+    bool corrupted_thrown = false;
+    try {
+        MappedSearchServer corrupted(path);
+    } catch (const runtime_error&) {
+        corrupted_thrown = true;
+    }
+    ASSERT_HINT(corrupted_thrown, "Out-of-range document index must be reported");
+    remove(path.c_str());
+
+    bool thrown = false;
+    try {
+        MappedSearchServer missing("no_such_search_index.snapshot"s);
+    } catch (const runtime_error&) {
+        thrown = true;
+    }
+    ASSERT_HINT(thrown, "Missing snapshot must be reported");
+}
+
+void TestShardedSearchServer() {
+    const string stop_words = "and with"s;
+    SearchServer server(stop_words);
+    ShardedSearchServer sharded(stop_words, 3);
+    const vector<string> texts = {"funny pet and nasty rat"s, "funny pet with curly hair"s, "nasty rat with curly hair"s,
+                                  "pet with rat and rat and rat"s, "curly dog"s, "nasty curly cat"s, "funny dog"s};
+    for (int id = 0; id < static_cast<int>(texts.size()); ++id) {
+        const DocumentStatus status = id == 4 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+        server.AddDocument(id, texts[id], status, {id});
+        sharded.AddDocument(id, texts[id], status, {id});
+    }
+    server.RemoveDocument(6);
+    sharded.RemoveDocument(6);
+    ASSERT_EQUAL_HINT(sharded.GetDocumentCount(), server.GetDocumentCount(), "Shards must hold every document");
+
+    for (const string& query : {"curly rat"s, "funny -nasty"s, "pet dog"s, "curly"s}) {
+        for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+            const auto expected = server.FindTopDocuments(query, status, 3);
+            const auto found = sharded.FindTopDocuments(query, status, 3);
+            ASSERT_EQUAL_HINT(found.size(), expected.size(), "Sharded search must find the same documents");
+            for (size_t i = 0; i < found.size(); ++i) {
+                ASSERT_EQUAL_HINT(found[i].id, expected[i].id, "Sharded search must rank like one server");
+                ASSERT_HINT(abs(found[i].relevance - expected[i].relevance) < 1e-6, "Sharded search must use global IDF");
+            }
+        }
+    }
+
+    bool thrown = false;
+    try {
+        sharded.AddDocument(3, "dog"s, DocumentStatus::ACTUAL, {});
+    } catch (const invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT_HINT(thrown, "Existing id must be rejected by its shard");
+
+    // Отказ удалённой части передаётся вызывающему потоку
+    class FailingShard : public LocalSearchShard {
+    public:
+        explicit FailingShard(bool fails_on_freqs)
+            : LocalSearchShard(SearchServer(""s)), fails_on_freqs_(fails_on_freqs) {
+        }
+
+        vector<int> GetDocumentFreqs(const vector<string_view>& words) const override {
+            if (fails_on_freqs_) {
+                throw runtime_error("shard unavailable"s);
+            }
+            return LocalSearchShard::GetDocumentFreqs(words);
+        }
+
+        vector<Document> FindTopDocuments(const Query&, const vector<double>&, DocumentStatus, size_t) const override {
+            throw runtime_error("shard unavailable"s);
+        }
+
+    private:
+        bool fails_on_freqs_;
+    };
+    for (const bool fails_on_freqs : {true, false}) {
+        vector<unique_ptr<SearchShard>> shards;
+        shards.push_back(make_unique<LocalSearchShard>(SearchServer(""s)));
+        shards.push_back(make_unique<FailingShard>(fails_on_freqs));
+        ShardedSearchServer failing(""s, move(shards));
+        failing.AddDocument(0, "cat"s, DocumentStatus::ACTUAL, {1});
+        bool shard_thrown = false;
+        try {
+            failing.FindTopDocuments("cat"s);
+        } catch (const runtime_error&) {
+            shard_thrown = true;
+        }
+        ASSERT_HINT(shard_thrown, "Shard failure must reach the caller");
+    }
+}
+
+void TestVersionedSearchServer() {
+    {
+        SearchServer original("and"s);
+        original.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, {1});
+        original.AddDocument(2, "curly pet"s, DocumentStatus::ACTUAL, {2});
+        original.RemoveDocument(2);
+        SearchServer copy = original;
+        original = SearchServer();
+        ASSERT_EQUAL_HINT(copy.FindTopDocuments("pet"s).size(), 1, "Copy must not depend on the original");
+        ASSERT_EQUAL_HINT(get<0>(copy.MatchDocument("nasty rat and"s, 1)).size(), 2, "Copy must keep its own words");
+        ASSERT_EQUAL_HINT(copy.GetWordFrequencies(1).size(), 4, "Copy must keep the forward index");
+    }
+
+    VersionedSearchServer server(SearchServer("and"s));
+    server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, {1});
+    const auto old_version = server.GetSnapshot();
+    const auto [old_words, old_status] = old_version->MatchDocument("funny rat"s, 1);
+
+    atomic<bool> stop = false;
+    atomic<int> failed_reads = 0;
+    vector<thread> readers;
+    for (int i = 0; i < 2; ++i) {
+        readers.emplace_back([&]() {
+            while (!stop) {
+                const auto snapshot = server.GetSnapshot();
+                // Внутри одной версии документы не появляются и не исчезают
+                if (snapshot->FindTopDocuments("pet"s, DocumentStatus::ACTUAL, 100).size()
+                    != static_cast<size_t>(snapshot->GetDocumentCount())) {
+                    ++failed_reads;
+                }
+            }
+        });
+    }
+    for (int id = 2; id < 30; ++id) {
+        server.AddDocument(id, "curly pet"s, DocumentStatus::ACTUAL, {id});
+    }
+    server.Update([](SearchServer& next) {
+        next.RemoveDocument(5);
+        next.RemoveDocument(6);
+    });
+    stop = true;
+    for (thread& reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQUAL_HINT(failed_reads.load(), 0, "Readers must always see a consistent version");
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 27, "Every update must be published");
+    ASSERT_EQUAL_HINT(old_version->GetDocumentCount(), 1, "Old version must stay unchanged");
+    ASSERT_HINT(old_words.size() == 2 && old_words[0] == "funny"sv, "Old version words must stay valid");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("curly"s, DocumentStatus::ACTUAL, 100).size(), 26, "New version must be searchable");
+
+    // Пакет публикуется одной версией: снимок до вызова его не видит, снимок после - видит целиком
+    const auto before_batch = server.GetSnapshot();
+    server.AddDocuments(vector<RawDocument>{{100, "grey dog"s, DocumentStatus::ACTUAL, {1}},
+                                            {101, "white dog"s, DocumentStatus::ACTUAL, {2}}});
+    ASSERT_HINT(before_batch->FindTopDocuments("dog"s).empty(), "Batch must not leak into an older version");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s).size(), 2, "Batch must be published as a whole");
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 29, "Batch must add every document");
+}
+
+void TestStatusMasks() {
+    SearchServer server;
+    server.AddDocument(4, "cat dog"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(1, "cat"s, DocumentStatus::BANNED, {5});
+    server.AddDocuments(vector<RawDocument>{{3, "cat"s, DocumentStatus::ACTUAL, {7}},
+                                            {2, "dog"s, DocumentStatus::ACTUAL, {3}}});
+    server.AddDocument(5, "cat"s, DocumentStatus::ACTUAL, {9});
+    server.RemoveDocument(5);
+    ASSERT_EQUAL_HINT(server.GetStatusMask(DocumentStatus::ACTUAL).Count(), 3, "Removed documents must leave the status mask");
+    ASSERT_EQUAL_HINT(server.GetStatusMask(DocumentStatus::BANNED).Count(), 1, "Status mask must hold documents of its status");
+
+    const DocumentMask mask = server.GetStatusMask(DocumentStatus::ACTUAL) & server.MakeRatingMask(2, 8);
+    const auto by_mask = server.FindTopDocuments("cat dog"s, mask);
+    const auto by_predicate = server.FindTopDocuments("cat dog"s, [](int, DocumentStatus status, int rating) {
+        return status == DocumentStatus::ACTUAL && 2 <= rating && rating <= 8;
+    });
+    ASSERT_EQUAL_HINT(by_mask.size(), 2, "Mask must select documents 2 and 3");
+    ASSERT_EQUAL_HINT(by_mask.size(), by_predicate.size(), "Mask and predicate must select the same documents");
+    for (size_t i = 0; i < by_mask.size(); ++i) {
+        ASSERT_EQUAL_HINT(by_mask[i].id, by_predicate[i].id, "Mask and predicate must rank documents equally");
+        ASSERT_HINT(abs(by_mask[i].relevance - by_predicate[i].relevance) < RELEVANCE_EPSILON, "Relevance must not depend on the filter");
+    }
+    ASSERT_EQUAL_HINT(server.FindTopDocuments(execution::par, server.ParseQuery("cat"s), mask).size(), 1,
+                      "Parallel search must use the mask too");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s, DocumentStatus::BANNED)[0].id, 1, "Status search must go through the mask");
+}
+
+void TestDenseScoreAccumulator() {
+    SearchServer big_server;
+    for (int id = 0; id < 100; ++id) {
+        big_server.AddDocument(id * 3, id % 2 == 0 ? "cat"s : "cat dog"s, DocumentStatus::ACTUAL, {id});
+    }
+    ASSERT_EQUAL_HINT(big_server.FindTopDocuments("dog"s, DocumentStatus::ACTUAL, 100).size(), 50, "Must find every document with the word");
+
+    // Буфер потока переиспользуется: следующий запрос к меньшему серверу не должен видеть прежних сумм
+    SearchServer server;
+    server.AddDocument(10, "cat"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(20, "cat dog"s, DocumentStatus::ACTUAL, {2});
+    server.AddDocument(30, "bird"s, DocumentStatus::ACTUAL, {3});
+    server.RemoveDocument(30);
+    const auto documents = server.FindTopDocuments("cat dog"s);
+    ASSERT_EQUAL_HINT(documents.size(), 2, "Only documents of this server must be found");
+    ASSERT_EQUAL_HINT(documents[0].id, 20, "Document with both words must be first");
+    ASSERT_EQUAL_HINT(documents[1].id, 10, "Document with one word must be second");
+    ASSERT_HINT(abs(documents[1].relevance) < RELEVANCE_EPSILON, "Word of every document has zero IDF");
+    ASSERT_HINT(abs(documents[0].relevance - log(2.0) / 2) < RELEVANCE_EPSILON, "Relevance must be TF-IDF");
+
+    const auto parallel_documents = server.FindTopDocuments(execution::par, "cat dog -bird"s);
+    ASSERT_EQUAL_HINT(parallel_documents.size(), 2, "Parallel search must find the same documents");
+    ASSERT_HINT(server.FindTopDocuments("cat -dog"s)[0].id == 10 && server.FindTopDocuments("cat -dog"s).size() == 1,
+                "Minus word must exclude document from the dense accumulator");
+}
+
+void TestScoringKernels() {
+    const size_t document_count = 1000;
+    vector<uint32_t> ordinals;
+    vector<double> term_freqs;
+    for (uint32_t ordinal = 1; ordinal < document_count; ordinal += 1 + ordinal % 3) {
+        ordinals.push_back(ordinal);
+        term_freqs.push_back(1.0 / (ordinal + 1));
+    }
+    vector<pair<AccumulateScoresKernel, CollectMatchedKernel>> kernels = {{GetAccumulateScoresKernel(), GetCollectMatchedKernel()}};
+#ifdef SEARCH_SERVER_X86_SIMD
+    if (DetectSimdLevel() >= SimdLevel::AVX2) {
+        kernels.push_back({&AccumulateScoresAvx2, &CollectMatchedAvx2});
+    }
+    if (DetectSimdLevel() == SimdLevel::AVX512) {
+        kernels.push_back({&AccumulateScoresAvx512, &CollectMatchedAvx2});
+    }
+#endif
+    // Длины не кратны ширине векторов, чтобы проверить и хвосты
+    for (const size_t count : {size_t{0}, size_t{3}, size_t{13}, ordinals.size()}) {
+        vector<double> expected_scores(document_count, 0.5);
+        vector<char> expected_matched(document_count);
+        AccumulateScoresScalar(ordinals.data(), term_freqs.data(), count, 0.7, expected_scores.data(), expected_matched.data());
+        pmr::vector<uint32_t> expected_ordinals;
+        CollectMatchedScalar(expected_matched.data(), document_count, expected_ordinals);
+        ASSERT_HINT(equal(expected_ordinals.begin(), expected_ordinals.end(), ordinals.begin(), ordinals.begin() + count),
+                    "Scalar collection must return matched ordinals in order");
+        for (const auto& [accumulate_scores, collect_matched] : kernels) {
+            vector<double> scores(document_count, 0.5);
+            vector<char> is_matched(document_count);
+            accumulate_scores(ordinals.data(), term_freqs.data(), count, 0.7, scores.data(), is_matched.data());
+            ASSERT_HINT(scores == expected_scores, "Vector kernel must give bitwise equal scores");
+            ASSERT_HINT(is_matched == expected_matched, "Vector kernel must mark every matched document");
+            pmr::vector<uint32_t> matched_ordinals;
+            collect_matched(is_matched.data(), document_count, matched_ordinals);
+            ASSERT_HINT(matched_ordinals == expected_ordinals, "Vector scan must collect the same ordinals");
+        }
+    }
+}
+
+void TestCompressedPostings() {
+    PostingList postings;
+    vector<uint32_t> expected_ordinals;
+    // Большинство чисел вхождений занимает один байт varint, редкие - несколько
+    const auto term_count = [](uint32_t i) {
+        return i % 97 == 0 ? 1000 + i : 1 + i % 3;
+    };
+    uint32_t ordinal = 0;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        // Разные ширины разностей, включая почти предельную
+        ordinal += i == 500 ? 3'000'000'000u : 1 + i % 7;
+        expected_ordinals.push_back(ordinal);
+        postings.Add(ordinal, term_count(i), 1.0);
+    }
+    ASSERT_EQUAL_HINT(postings.GetSize(), 1000, "Every posting must be stored");
+    ASSERT_HINT(postings.GetMemoryUsage() < 1000 * (sizeof(uint32_t) + sizeof(double)) / 4,
+                "Postings must take several times less memory than plain arrays");
+
+    const auto decode_all = [&postings] {
+        vector<pair<uint32_t, uint32_t>> result;
+        postings.ForEachBlock([&result](const uint32_t* ordinals, const uint32_t* term_counts, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                result.emplace_back(ordinals[i], term_counts[i]);
+            }
+        });
+        return result;
+    };
+    auto decoded = decode_all();
+    ASSERT_EQUAL_HINT(decoded.size(), expected_ordinals.size(), "Decoding must return every posting");
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        ASSERT_EQUAL_HINT(decoded[i].first, expected_ordinals[i], "Ordinals must survive encoding");
+        ASSERT_EQUAL_HINT(decoded[i].second, term_count(i), "Term counts must survive encoding");
+    }
+    for (size_t i = 0; i + 1 < postings.GetBlockCount(); ++i) {
+        ASSERT_HINT(postings.GetBlockInfo(i).last_ordinal < postings.GetBlockInfo(i + 1).first_ordinal,
+                    "Skip data must keep blocks ordered");
+    }
+
+    // Удаляется целый первый блок и отдельные вхождения в середине и в хвосте
+    for (size_t i = 0; i < 1000; ++i) {
+        if (i < PostingList::BLOCK_SIZE || i == 300 || i == 999) {
+            postings.Erase(expected_ordinals[i]);
+        }
+    }
+    postings.Erase(expected_ordinals[302] + 1);
+    ASSERT_EQUAL_HINT(postings.GetSize(), 1000 - PostingList::BLOCK_SIZE - 2, "Erase must remove only existing postings");
+    ASSERT_HINT(!postings.Contains(expected_ordinals[300]) && !postings.Contains(expected_ordinals[5]),
+                "Erased postings must not be found");
+    ASSERT_HINT(postings.Contains(expected_ordinals[301]) && postings.Contains(expected_ordinals[998]),
+                "Other postings must stay");
+    decoded = decode_all();
+    ASSERT_EQUAL_HINT(decoded.size(), postings.GetSize(), "Decoding after erase must return the rest");
+    ASSERT_EQUAL_HINT(decoded[300 - PostingList::BLOCK_SIZE].first, expected_ordinals[301],
+                      "Blocks after the edited one must stay readable");
+
+    SearchServer server;
+    for (int id = 0; id < 300; ++id) {
+        server.AddDocument(id, id % 3 == 0 ? "cat cat dog"s : "dog bird"s, DocumentStatus::ACTUAL, {id});
+    }
+    server.RemoveDocument(3);
+    ASSERT_EQUAL_HINT(server.GetDocumentFreq("cat"s), 99, "Document frequency must follow compressed postings");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s, DocumentStatus::ACTUAL, 1000).size(), 99, "Search must read every block");
+    ASSERT_HINT(abs(server.GetWordFrequencies(6).at("cat"sv) - 2.0 / 3) < RELEVANCE_EPSILON, "TF must be count over length");
+    ASSERT_HINT(get<0>(server.MatchDocument("cat"s, 297)).size() == 1 && get<0>(server.MatchDocument("cat"s, 2)).empty(),
+                "Match must find words through skip data");
+}
+
+void TestPrunedTopDocuments() {
+    // Частые слова встречаются почти везде, редкие - в немногих документах
+    const vector<string> words = {"a"s, "b"s, "c"s, "d"s, "e"s, "f"s, "g"s, "h"s, "i"s, "j"s, "k"s, "l"s};
+    SearchServer server;
+    uint32_t seed = 12345;
+    const auto next_random = [&seed] {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 16;
+    };
+    for (int id = 0; id < 2000; ++id) {
+        string text;
+        for (size_t i = 0; i < words.size(); ++i) {
+            for (uint32_t count = next_random() % (i + 2); count == 0 && next_random() % (i + 1) == 0; ++count) {
+                text += words[i] + ' ';
+            }
+            if (next_random() % (i + 1) == 0) {
+                text += words[i] + ' ';
+            }
+        }
+        text += "z"s;
+        // Рейтинги различны, чтобы порядок документов с почти равной релевантностью был однозначным
+        server.AddDocument(id, text, static_cast<DocumentStatus>(id % 3 == 0 ? 1 : 0), {id});
+    }
+    const vector<string> queries = {"a b"s, "a b c d e"s, "a c -b"s, "b d f h j l"s, "a z"s, "k l c a h"s, "a b c -z"s};
+    for (const string& query : queries) {
+        for (const size_t max_result_count : {size_t{1}, size_t{5}, size_t{20}}) {
+            const auto pruned = server.FindTopDocuments(query, DocumentStatus::ACTUAL, max_result_count);
+            const auto exhaustive = server.FindTopDocuments(execution::par, query, DocumentStatus::ACTUAL, max_result_count);
+            ASSERT_EQUAL_HINT(pruned.size(), exhaustive.size(), "Pruned search must return as many documents as exhaustive");
+            for (size_t i = 0; i < pruned.size(); ++i) {
+                ASSERT_EQUAL_HINT(pruned[i].id, exhaustive[i].id, "Pruned search must return the same documents in order");
+                ASSERT_HINT(pruned[i].relevance == exhaustive[i].relevance, "Pruned search must compute the same relevance");
+            }
+            const auto by_predicate = server.FindTopDocuments(query, [](int document_id, DocumentStatus, int) {
+                return document_id % 4 != 0;
+            }, max_result_count);
+            const auto by_predicate_exhaustive = server.FindTopDocuments(execution::par, query, [](int document_id, DocumentStatus, int) {
+                return document_id % 4 != 0;
+            }, max_result_count);
+            ASSERT_EQUAL_HINT(by_predicate.size(), by_predicate_exhaustive.size(), "Predicate must be applied before pruning");
+            for (size_t i = 0; i < by_predicate.size(); ++i) {
+                ASSERT_EQUAL_HINT(by_predicate[i].id, by_predicate_exhaustive[i].id, "Pruning must respect the predicate");
+            }
+        }
+    }
+}
+
+void TestQueryResultCache() {
+    SearchServer server("and in on"s);
+    server.AddDocument(1, "fluffy cat"s, DocumentStatus::ACTUAL, {5});
+    server.AddDocument(2, "fluffy dog"s, DocumentStatus::ACTUAL, {3});
+    server.AddDocument(3, "groomed cat"s, DocumentStatus::BANNED, {1});
+    const auto ids = [](const vector<Document>& documents) {
+        vector<int> result;
+        for (const Document& document : documents) {
+            result.push_back(document.id);
+        }
+        return result;
+    };
+
+    QueryResultCache cache(8);
+    const auto first = cache.FindTopDocuments(server, "fluffy cat"s);
+    ASSERT_EQUAL_HINT(cache.GetMissCount(), 1u, "First query must miss");
+    // Порядок слов, повторы и стоп-слова не меняют разобранный запрос
+    const auto second = cache.FindTopDocuments(server, "cat and fluffy cat"s);
+    ASSERT_EQUAL_HINT(cache.GetHitCount(), 1u, "Queries equal after parsing must share an entry");
+    ASSERT_HINT(ids(first) == ids(second), "Cached result must be returned");
+
+    cache.FindTopDocuments(server, "fluffy cat"s, DocumentStatus::BANNED);
+    cache.FindTopDocuments(server, "fluffy cat"s, DocumentStatus::ACTUAL, 1);
+    cache.FindTopDocuments(server, "fluffy -cat"s);
+    ASSERT_EQUAL_HINT(cache.GetMissCount(), 4u, "Status, result count and minus words must be part of the key");
+
+    const uint64_t generation = server.GetGeneration();
+    server.AddDocument(4, "cat cat"s, DocumentStatus::ACTUAL, {9});
+    ASSERT_HINT(server.GetGeneration() != generation, "Adding a document must change the generation");
+    const auto after_add = cache.FindTopDocuments(server, "fluffy cat"s);
+    ASSERT_EQUAL_HINT(cache.GetMissCount(), 5u, "Adding a document must invalidate the entry");
+    ASSERT_HINT(ids(after_add) == ids(server.FindTopDocuments("fluffy cat"s)), "Result must reflect the new index");
+
+    server.RemoveDocument(4);
+    cache.FindTopDocuments(server, "fluffy cat"s);
+    ASSERT_EQUAL_HINT(cache.GetMissCount(), 6u, "Removing a document must invalidate the entry");
+    const uint64_t after_remove = server.GetGeneration();
+    server.RemoveDocument(100);
+    ASSERT_EQUAL_HINT(server.GetGeneration(), after_remove, "Removing an unknown document must keep the generation");
+    cache.FindTopDocuments(server, "fluffy cat"s);
+    ASSERT_EQUAL_HINT(cache.GetHitCount(), 2u, "Entry must stay valid while the index is unchanged");
+
+    QueryResultCache small_cache(1, 1);
+    small_cache.FindTopDocuments(server, "cat"s);
+    small_cache.FindTopDocuments(server, "dog"s);
+    small_cache.FindTopDocuments(server, "cat"s);
+    ASSERT_EQUAL_HINT(small_cache.GetMissCount(), 3u, "Least recently used entry must be evicted");
+    small_cache.FindTopDocuments(server, "cat"s);
+    ASSERT_EQUAL_HINT(small_cache.GetHitCount(), 1u, "Most recent entry must stay cached");
+    small_cache.Clear();
+    small_cache.FindTopDocuments(server, "cat"s);
+    ASSERT_EQUAL_HINT(small_cache.GetMissCount(), 4u, "Clear must drop every entry");
+}
+
+void TestRequestQueue() {
+    SearchServer server("and in on"s);
+    server.AddDocument(1, "fluffy cat"s, DocumentStatus::ACTUAL, {5});
+    server.AddDocument(2, "groomed dog"s, DocumentStatus::BANNED, {3});
+
+    RequestQueue request_queue(server);
+    for (int i = 0; i < 1439; ++i) {
+        request_queue.AddFindRequest("empty request"s);
+    }
+    ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1439, "Every empty request must be counted");
+    request_queue.AddFindRequest("fluffy cat"s);
+    ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1439, "Found request must not be counted");
+    // Окно заполнено: каждый новый запрос вытесняет самый старый
+    request_queue.AddFindRequest("dog"s, DocumentStatus::BANNED);
+    ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1438, "Oldest request must leave the window");
+    request_queue.AddFindRequest("dog"s);
+    ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1438, "Empty request must replace an empty one");
+    request_queue.AddFindRequest("cat"s, [](int document_id, DocumentStatus, int) {
+        return document_id == 1;
+    });
+    ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1437, "Predicate requests must be recorded too");
+}
+
+void TestBenchmarkCorpus() {
+    CorpusConfig config;
+    config.vocabulary_size = 50;
+    config.document_count = 20;
+    config.document_length = 7;
+    config.query_count = 200;
+    config.query_length = 3;
+    config.minus_word_ratio = 0.5;
+    CorpusGenerator generator(config);
+    const vector<string> documents = generator.GenerateDocuments();
+    const vector<string> queries = generator.GenerateQueries();
+    const vector<string>& vocabulary = generator.GetVocabulary();
+    ASSERT_EQUAL_HINT(set<string>(vocabulary.begin(), vocabulary.end()).size(), 50u, "Vocabulary words must be unique");
+    ASSERT_EQUAL_HINT(documents.size(), 20u, "Document count must be configurable");
+    for (const string& document : documents) {
+        ASSERT_EQUAL_HINT(SplitIntoWords(document).size(), 7u, "Document length must be configurable");
+        ASSERT_HINT(document.find('-') == string::npos, "Documents must not contain minus words");
+    }
+    size_t minus_word_count = 0;
+    for (const string& query : queries) {
+        for (const string_view word : SplitIntoWords(query)) {
+            minus_word_count += word[0] == '-';
+        }
+    }
+    ASSERT_HINT(minus_word_count > 200 && minus_word_count < 400, "Minus word ratio must be respected");
+
+    CorpusGenerator same_seed(config);
+    ASSERT_HINT(same_seed.GenerateDocuments() == documents, "Same seed must give the same corpus");
+
+    ZipfDistribution distribution(10, 1.0);
+    mt19937 random_generator(1);
+    vector<int> rank_counts(10);
+    for (int i = 0; i < 10000; ++i) {
+        ++rank_counts[distribution(random_generator)];
+    }
+    ASSERT_HINT(rank_counts[0] > rank_counts[1] && rank_counts[1] > rank_counts[9], "Lower ranks must be more frequent");
+
+    const CorpusConfig parsed = ParseCorpusConfig({"--documents=7"sv, "--zipf=1.5"sv, "--minus-ratio=0"sv});
+    ASSERT_EQUAL_HINT(parsed.document_count, 7u, "Document count must be parsed");
+    ASSERT_HINT(parsed.zipf_exponent == 1.5 && parsed.minus_word_ratio == 0, "Distribution parameters must be parsed");
+    try {
+        ParseCorpusConfig({"--unknown=1"sv});
+        ASSERT_HINT(false, "Unknown parameter must be rejected");
+    } catch (const invalid_argument&) {
+    }
+
+    ostringstream out;
+    {
+        LogDuration guard("scope"s, out);
+    }
+    ASSERT_HINT(out.str().rfind("scope: "s, 0) == 0, "Duration must be printed with its name");
+}
+
+void TestSearchMetrics() {
+    SearchServer server("and in on"s);
+    server.AddDocument(1, "fluffy cat"s, DocumentStatus::ACTUAL, {5});
+    server.AddDocument(2, "fluffy dog"s, DocumentStatus::ACTUAL, {3});
+    server.AddDocument(3, "groomed cat"s, DocumentStatus::ACTUAL, {1});
+    ASSERT_HINT(server.GetMetrics() == nullptr, "Metrics must be disabled by default");
+    server.FindTopDocuments("fluffy cat -dog"s);
+    const QueryTrace trace = SearchServer::GetLastQueryTrace();
+    ASSERT_EQUAL_HINT(trace.plus_word_count, 2u, "Trace must count plus words");
+    ASSERT_EQUAL_HINT(trace.minus_word_count, 1u, "Trace must count minus words");
+    ASSERT_EQUAL_HINT(trace.postings_scanned, 5u, "Exhaustive search must scan every posting of the query words");
+    ASSERT_EQUAL_HINT(trace.documents_matched, 2u, "Trace must count matched documents");
+    ASSERT_EQUAL_HINT(trace.documents_returned, 2u, "Trace must count returned documents");
+
+    server.EnableMetrics();
+    server.FindTopDocuments("fluffy cat -dog"s);
+    server.FindTopDocuments(execution::par, "cat"s);
+    server.AddDocument(4, "cat in hat"s, DocumentStatus::ACTUAL, {1});
+    const SearchMetrics::Snapshot snapshot = server.GetMetrics()->GetSnapshot();
+    ASSERT_EQUAL_HINT(snapshot.query_count, 2u, "Every search must be counted");
+    ASSERT_EQUAL_HINT(snapshot.postings_scanned, 7u, "Scanned postings must be summed over searches");
+    ASSERT_EQUAL_HINT(snapshot.GetStage(SearchStage::PARSE_QUERY).call_count, 2u, "Query parsing must be timed");
+    ASSERT_EQUAL_HINT(snapshot.GetStage(SearchStage::TOKENIZE).call_count, 3u, "Queries and documents must be tokenized");
+    ASSERT_EQUAL_HINT(snapshot.GetStage(SearchStage::SCORE).call_count, 2u, "Scoring must be timed");
+    ASSERT_EQUAL_HINT(snapshot.GetStage(SearchStage::EXCLUDE_MINUS_WORDS).call_count, 2u, "Minus word exclusion must be timed");
+    const SearchMetrics::StageStatistics& sort_top = snapshot.GetStage(SearchStage::SORT_TOP);
+    ASSERT_EQUAL_HINT(accumulate(sort_top.histogram.begin(), sort_top.histogram.end(), uint64_t{0}), sort_top.call_count,
+                      "Every call must land in a histogram bucket");
+
+    const SearchServer copy = server;
+    copy.FindTopDocuments("dog"s);
+    ASSERT_EQUAL_HINT(server.GetMetrics()->GetSnapshot().query_count, 3u, "Copies must share metrics");
+    ostringstream out;
+    server.GetMetrics()->WriteText(out);
+    ASSERT_HINT(out.str().find("search_queries_total 3\n"s) != string::npos, "Text format must include query count");
+    ASSERT_HINT(out.str().find("search_stage_duration_ns_count{stage=\"score\"} 3\n"s) != string::npos,
+                "Text format must include stage counts");
+    server.GetMetrics()->Reset();
+    ASSERT_EQUAL_HINT(server.GetMetrics()->GetSnapshot().query_count, 0u, "Reset must clear counters");
+    server.DisableMetrics();
+    ASSERT_HINT(server.GetMetrics() == nullptr, "Metrics must be disabled");
+
+    SearchServer large_server(""s);
+    for (int id = 0; id < 1000; ++id) {
+        large_server.AddDocument(id, id % 2 == 0 ? "a b"s : "b c"s, DocumentStatus::ACTUAL, {id});
     }
+    large_server.FindTopDocuments("a b"s, DocumentStatus::ACTUAL, 1);
+    const QueryTrace pruned_trace = SearchServer::GetLastQueryTrace();
+    ASSERT_HINT(pruned_trace.is_pruned, "Long top-1 search must be pruned");
+    ASSERT_HINT(pruned_trace.postings_scanned <= 1500u, "Pruned search must not scan more than the postings");
+    ASSERT_EQUAL_HINT(pruned_trace.documents_returned, 1u, "Pruned trace must count returned documents");
+}
 
-    struct QueryWord {
-        string data;
-        bool is_minus;
-        bool is_stop;
+void TestQueryArena() {
+    SearchServer server("and in on"s);
+    for (int id = 0; id < 2000; ++id) {
+        server.AddDocument(id, id % 3 == 0 ? "fluffy cat"s : (id % 3 == 1 ? "fluffy dog"s : "groomed cat and dog"s),
+                           DocumentStatus::ACTUAL, {id % 7});
+    }
+    const vector<string> queries = {"fluffy cat"s, "cat -dog"s, "groomed fluffy dog"s, "unknown"s};
+    const auto run_queries = [&server, &queries] {
+        for (const string& query : queries) {
+            server.FindTopDocuments(query);
+            server.FindTopDocuments(execution::par, query);
+            server.FindTopDocuments(query, [](int document_id, DocumentStatus, int) {
+                return document_id % 2 == 0;
+            }, 100);
+        }
     };
+    const QueryArena& arena = QueryArena::GetThreadArena();
+    run_queries();
+    run_queries();
+    const uint64_t heap_allocation_count = arena.GetHeapAllocationCount();
+    const size_t capacity = arena.GetCapacity();
+    run_queries();
+    ASSERT_EQUAL_HINT(arena.GetHeapAllocationCount(), heap_allocation_count, "Warm arena must not use the heap");
+    ASSERT_EQUAL_HINT(arena.GetCapacity(), capacity, "Warm arena must keep its size");
 
-    QueryWord ParseQueryWord(string text) const {
-        bool is_minus = false;
-        // Word shouldn't be empty
-        if (text[0] == '-') {
-            is_minus = true;
-            text = text.substr(1);
+    {
+        const QueryArena::Scope outer_scope;
+        pmr::vector<int> outer_values(outer_scope.GetResource());
+        outer_values.assign(10, 1);
+        {
+            const QueryArena::Scope inner_scope;
+            pmr::vector<char> large(capacity + 1, 'x', inner_scope.GetResource());
         }
-        return {text, is_minus, IsStopWord(text)};
+        // Вложенная область не сбрасывает память внешней
+        ASSERT_HINT(all_of(outer_values.begin(), outer_values.end(), [](int value) {
+            return value == 1;
+        }), "Nested scope must keep outer allocations");
+        ASSERT_HINT(arena.GetHeapAllocationCount() > heap_allocation_count, "Overflow must fall back to the heap");
     }
+    ASSERT_HINT(arena.GetCapacity() > capacity + 1, "Arena must grow to the peak usage");
+}
 
-    struct Query {
-        set<string> plus_words;
-        set<string> minus_words;
+void TestSegmentedSearchServer() {
+    const vector<string> words = {"cat"s, "dog"s, "fluffy"s, "groomed"s, "tail"s, "collar"s, "and"s};
+    SegmentedSearchServer segmented("and in"s, 4);
+    SearchServer reference("and in"s);
+    const auto add_document = [&](int id) {
+        string text;
+        for (size_t i = 0; i < words.size(); ++i) {
+            if ((id + i) % 3 == 0 || (id * i) % 5 == 1) {
+                text += words[i] + ' ';
+            }
+        }
+        text += words[id % words.size()];
+        const DocumentStatus status = id % 5 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+        segmented.AddDocument(id, text, status, {id});
+        reference.AddDocument(id, text, status, {id});
     };
-
-    Query ParseQuery(const string& text) const {
-        Query query;
-        for (const string& word : SplitIntoWords(text)) {
-            const QueryWord query_word = ParseQueryWord(word);
-            if (!query_word.is_stop) {
-                if (query_word.is_minus) {
-                    query.minus_words.insert(query_word.data);
-                } else {
-                    query.plus_words.insert(query_word.data);
+    const auto check_results = [&](const string& hint) {
+        ASSERT_EQUAL_HINT(segmented.GetDocumentCount(), reference.GetDocumentCount(), hint);
+        for (const string& query : {"cat"s, "fluffy dog"s, "tail -collar"s, "groomed cat collar"s}) {
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+                const auto expected = reference.FindTopDocuments(query, status, 10);
+                const auto found = segmented.FindTopDocuments(query, status, 10);
+                ASSERT_EQUAL_HINT(found.size(), expected.size(), hint);
+                for (size_t i = 0; i < found.size(); ++i) {
+                    ASSERT_EQUAL_HINT(found[i].id, expected[i].id, hint);
+                    ASSERT_HINT(found[i].relevance == expected[i].relevance, hint);
                 }
             }
         }
-        return query;
+    };
+
+    for (int id = 0; id < 40; ++id) {
+        add_document(id);
+    }
+    check_results("Segments must rank like a single server"s);
+    // Удаляются документы из запечатанных сегментов и из изменяемого
+    for (const int id : {1, 2, 7, 13, 21, 38, 39, 100}) {
+        segmented.RemoveDocument(id);
+        reference.RemoveDocument(id);
     }
+    check_results("Tombstones must be applied before merging"s);
+    try {
+        segmented.AddDocument(3, "cat"s, DocumentStatus::ACTUAL, {1});
+        ASSERT_HINT(false, "Id from a sealed segment must be rejected");
+    } catch (const invalid_argument&) {
+    }
+    segmented.AddDocument(2, "fluffy cat"s, DocumentStatus::ACTUAL, {2});
+    reference.AddDocument(2, "fluffy cat"s, DocumentStatus::ACTUAL, {2});
 
-    // Existence required
-    double ComputeWordInverseDocumentFreq(const string& word) const {
-        return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
+    segmented.Flush();
+    segmented.WaitForMerges();
+    ASSERT_HINT(segmented.GetSegmentCount() < 5, "Background merge must reduce the segment count");
+    check_results("Merged segments must rank like a single server"s);
+    for (int id = 16; id < 32; ++id) {
+        segmented.RemoveDocument(id);
+        reference.RemoveDocument(id);
     }
+    segmented.WaitForMerges();
+    check_results("Merges must drop removed documents"s);
+}
 
-    template <typename DocumentPredicate>
-    vector<Document> FindAllDocuments(const Query& query, DocumentPredicate document_predicate) const {
-        map<int, double> document_to_relevance;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto [document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                const auto& document_data = documents_.at(document_id);
-                if (document_predicate(document_id, document_data.status, document_data.rating)) {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
+void TestCorpusLoader() {
+    const string corpus = "5\tACTUAL\t7 2 7\tfluffy cat fluffy tail\r\n"s
+                          "1\t0\t1 2\tfluffy dog and collar\n"s
+                          "\n"s
+                          "3\tBANNED\t\tgroomed dog\n"s
+                          "8\t1\t-4\tcat with hat\n"s
+                          "4\tACTUAL\t1 1 1\tbig dog"s;
+    SearchServer expected("and"s);
+    expected.AddDocument(5, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    expected.AddDocument(1, "fluffy dog and collar"s, DocumentStatus::ACTUAL, {1, 2});
+    expected.AddDocument(3, "groomed dog"s, DocumentStatus::BANNED, {});
+    expected.AddDocument(8, "cat with hat"s, DocumentStatus::IRRELEVANT, {-4});
+    expected.AddDocument(4, "big dog"s, DocumentStatus::ACTUAL, {1, 1, 1});
+    const auto check_loaded = [&expected](const SearchServer& server, const string& hint) {
+        ASSERT_EQUAL_HINT(server.GetDocumentCount(), expected.GetDocumentCount(), hint);
+        for (const string& query : {"fluffy dog"s, "cat -tail"s, "dog"s}) {
+            for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED, DocumentStatus::IRRELEVANT}) {
+                const auto found = server.FindTopDocuments(query, status);
+                const auto reference = expected.FindTopDocuments(query, status);
+                ASSERT_EQUAL_HINT(found.size(), reference.size(), hint);
+                for (size_t i = 0; i < found.size(); ++i) {
+                    ASSERT_HINT(found[i].id == reference[i].id && found[i].rating == reference[i].rating
+                                && found[i].relevance == reference[i].relevance, hint);
                 }
             }
         }
+    };
 
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            for (const auto [document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
-            }
-        }
-
-        vector<Document> matched_documents;
-        for (const auto [document_id, relevance] : document_to_relevance) {
-            matched_documents.push_back({document_id, relevance, documents_.at(document_id).rating});
+    // Крошечные куски и пакеты: строки переходят через границы кусков
+    CorpusLoadOptions options;
+    options.batch_size = 2;
+    options.chunk_size = 7;
+    options.queue_capacity = 1;
+    {
+        SearchServer server("and"s);
+        istringstream input(corpus);
+        ASSERT_EQUAL_HINT(CorpusLoader(server, options).Load(input), 5u, "Every line must be loaded");
+        check_loaded(server, "Streamed corpus must match AddDocument"s);
+    }
+    {
+        const string path = "search_corpus_test.tsv"s;
+        ofstream(path, ios::binary) << corpus;
+        SearchServer server("and"s);
+        ASSERT_EQUAL_HINT(CorpusLoader(server, options).LoadFile(path), 5u, "Every line of the file must be loaded");
+        check_loaded(server, "Mapped corpus must match AddDocument"s);
+        ofstream(path, ios::binary | ios::trunc);
+        ASSERT_EQUAL_HINT(CorpusLoader(server, options).LoadFile(path), 0u, "Empty file must load nothing");
+        remove(path.c_str());
+    }
+    {
+        SearchServer server(""s);
+        istringstream input("1\tACTUAL\t1\tcat\n2\tUNKNOWN\t1\tdog\n"s);
+        try {
+            CorpusLoader(server, options).Load(input);
+            ASSERT_HINT(false, "Invalid status must be rejected");
+        } catch (const invalid_argument& error) {
+            ASSERT_HINT(string(error.what()).find("2"s) != string::npos, "Error must name the line");
         }
-        return matched_documents;
     }
-};
-
-void AssertImpl(bool value, const string& expr_str, const string& file, const string& func, unsigned line,
-                const string& hint) {
-    if (!value) {
-        cout << file << "("s << line << "): "s << func << ": "s;
-        cout << "ASSERT("s << expr_str << ") failed."s;
-        if (!hint.empty()) {
-            cout << " Hint: "s << hint;
+    {
+        SearchServer server(""s);
+        server.AddDocument(2, "cat"s, DocumentStatus::ACTUAL, {1});
+        istringstream input("1\t0\t1\tcat\n2\t0\t1\tdog\n3\t0\t1\tdog\n"s);
+        try {
+            CorpusLoader(server, options).Load(input);
+            ASSERT_HINT(false, "Duplicate id must stop the pipeline");
+        } catch (const invalid_argument&) {
         }
-        cout << endl;
-        abort();
     }
 }
 
-template <typename T, typename U>
-void AssertEqualImpl(const T& t, const U& u, const string& t_str, const string& u_str, const string& file,
-                     const string& func, unsigned line, const string& hint) {
-    if (t != u) {
-        cout << boolalpha;
-        cout << file << "("s << line << "): "s << func << ": "s;
-        cout << "ASSERT_EQUAL("s << t_str << ", "s << u_str << ") failed: "s;
-        cout << t << " != "s << u << "."s;
-        if (!hint.empty()) {
-            cout << " Hint: "s << hint;
+void TestCompileTimePredicates() {
+    SearchServer server;
+    server.AddDocument(4, "cat dog"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(1, "cat"s, DocumentStatus::BANNED, {5});
+    server.AddDocument(3, "cat hat"s, DocumentStatus::ACTUAL, {7});
+    server.AddDocument(2, "dog"s, DocumentStatus::IRRELEVANT, {3});
+    server.AddDocument(5, "cat"s, DocumentStatus::ACTUAL, {9});
+    server.RemoveDocument(5);
+
+    const auto check_same = [](const vector<Document>& lhs, const vector<Document>& rhs, const string& hint) {
+        ASSERT_EQUAL_HINT(lhs.size(), rhs.size(), hint);
+        for (size_t i = 0; i < lhs.size(); ++i) {
+            ASSERT_EQUAL_HINT(lhs[i].id, rhs[i].id, hint);
+            ASSERT_HINT(abs(lhs[i].relevance - rhs[i].relevance) < RELEVANCE_EPSILON, hint);
         }
-        cout << endl;
-        abort();
-    }
-}
+    };
+    const string query = "cat dog hat"s;
 
-template <typename TestType>
-void RunTest(const TestType& test, const string& test_name) {
-    test();
-    cerr << test_name << " OK" << endl;
+    const auto all = server.FindTopDocuments(query, AcceptAll{});
+    ASSERT_EQUAL_HINT(all.size(), 4, "AcceptAll must keep every document except removed ones");
+    check_same(all, server.FindTopDocuments(query, [](int, DocumentStatus, int) { return true; }), "AcceptAll must match a lambda accepting everything");
+    check_same(all, server.FindTopDocuments(execution::par, query, AcceptAll{}), "AcceptAll must not depend on the policy");
+
+    const auto actual = server.FindTopDocuments(query, StatusIs<DocumentStatus::ACTUAL>{});
+    ASSERT_EQUAL_HINT(actual.size(), 2, "StatusIs must select documents 3 and 4");
+    check_same(actual, server.FindTopDocuments(query, DocumentStatus::ACTUAL), "StatusIs must match the status overload");
+    check_same(server.FindTopDocuments(execution::par, query, StatusIs<DocumentStatus::BANNED>{}),
+               server.FindTopDocuments(query, [](int, DocumentStatus status, int) { return status == DocumentStatus::BANNED; }),
+               "StatusIs must match a status lambda");
+
+    const auto rated = server.FindTopDocuments(query, RatingAtLeast<5>{});
+    ASSERT_EQUAL_HINT(rated.size(), 2, "RatingAtLeast must select documents 1 and 3");
+    check_same(rated, server.FindTopDocuments(execution::par, query, [](int, DocumentStatus, int rating) { return rating >= 5; }),
+               "RatingAtLeast must match a rating lambda");
+
+    // Готовые предикаты работают и как обычные функции
+    ASSERT_HINT(StatusIs<DocumentStatus::ACTUAL>{}(1, DocumentStatus::ACTUAL, 0), "StatusIs must accept its status");
+    ASSERT_HINT(!RatingAtLeast<5>{}(1, DocumentStatus::ACTUAL, 4), "RatingAtLeast must reject lower ratings");
+    // cat, dog, hat встречаются в 3, 2 и 1 документах из 4
+    const vector<double> idfs = {log(4.0 / 3.0), log(2.0), log(4.0)};
+    check_same(server.FindTopDocumentsWithIdf(execution::seq, server.ParseQuery(query), idfs, RatingAtLeast<5>{}), rated,
+               "Tags must work with externally supplied IDF");
 }
 
-void TestDocumentAddition () {
-    const string content = "content"s;
-    const vector<int> ratings = {0};
-    {
-    SearchServer server;
-    server.AddDocument(0, content, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(1, content, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(2, content, DocumentStatus::ACTUAL, ratings);
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("content"s).size(), 3, "Must have 3 documnets");
-    ASSERT_HINT(server.FindTopDocuments("cat"s).empty(), "Must have no results");
+void TestStopWordSet() {
+    const StopWordSet empty;
+    ASSERT_HINT(!empty.Contains("cat"s), "Empty set must not contain words");
+    ASSERT_HINT(!empty.Contains(""s), "Empty set must not contain the empty word");
+
+    // Тысячи стоп-слов разной длины по образцу настоящих списков
+    vector<string> words;
+    for (int i = 0; i < 5000; ++i) {
+        words.push_back("w"s + to_string(i * 7));
+    }
+    words.push_back("w0"s);
+    const StopWordSet stop_words(words);
+    ASSERT_EQUAL_HINT(stop_words.size(), 5000, "Duplicate stop words must be stored once");
+    for (int i = 0; i < 35000; ++i) {
+        const string word = "w"s + to_string(i);
+        ASSERT_EQUAL_HINT(stop_words.Contains(word), i % 7 == 0, "Lookup must find exactly the stop words");
     }
+    ASSERT_HINT(!stop_words.Contains("x0"s), "Words with a foreign first byte must be rejected");
+    ASSERT_HINT(!stop_words.Contains("w0000000000"s), "Words of a foreign length must be rejected");
+    ASSERT_HINT(is_sorted(stop_words.begin(), stop_words.end()), "Stop words must be enumerated in order");
+
+    SearchServer server(words);
+    server.AddDocument(1, "w0 cat w7 w1"s, DocumentStatus::ACTUAL, {1});
+    const auto [matched_words, status] = server.MatchDocument("cat w1 w7"s, 1);
+    ASSERT_EQUAL_HINT(matched_words.size(), 2, "Stop words must be skipped in documents and queries");
+    ASSERT_HINT(server.FindTopDocuments("w14 w21"s).empty(), "Query of stop words only must find nothing");
 }
 
+void TestPhraseQueries() {
+    SearchServer server("и"s);
+    server.EnablePositions();
+    server.AddDocument(1, "пушистый кот и модный ошейник"s, DocumentStatus::ACTUAL, {1});
+    server.AddDocument(2, "кот пушистый"s, DocumentStatus::ACTUAL, {2});
+    server.AddDocument(3, "пушистый рыжий кот"s, DocumentStatus::ACTUAL, {3});
+    server.AddDocument(4, "модный пушистый кот"s, DocumentStatus::ACTUAL, {4});
 
-// Тест проверяет, что поисковая система исключает стоп-слова при добавлении документов
-void TestExcludeStopWordsFromAddedDocumentContent() {
-    const int doc_id = 42;
-    const string content = "cat in the city"s;
-    const vector<int> ratings = {1, 2, 3};
-    // Сначала убеждаемся, что поиск слова, не входящего в список стоп-слов,
-    // находит нужный документ
-    {
-        SearchServer server;
-        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
-        const auto found_docs = server.FindTopDocuments("in"s);
-        ASSERT_EQUAL_HINT(found_docs.size(), 1, "Must have no results");
-        const Document& doc0 = found_docs[0];
-        ASSERT_EQUAL_HINT(doc0.id, doc_id, "Document ID must be 42");
+    const auto get_ids = [](const vector<Document>& documents) {
+        vector<int> ids;
+        for (const Document& document : documents) {
+            ids.push_back(document.id);
+        }
+        sort(ids.begin(), ids.end());
+        return ids;
+    };
+    ASSERT_HINT(get_ids(server.FindTopDocuments("\"пушистый кот\""s)) == (vector<int>{1, 4}), "Phrase words must be adjacent and in order");
+    ASSERT_HINT(get_ids(server.FindTopDocuments(execution::par, "\"пушистый кот\""s)) == (vector<int>{1, 4}), "Phrase search must not depend on the policy");
+    ASSERT_HINT(get_ids(server.FindTopDocuments("\"пушистый кот\"~1"s)) == (vector<int>{1, 3, 4}), "Proximity must allow the given gap");
+    ASSERT_HINT(get_ids(server.FindTopDocuments("\"пушистый кот\" -ошейник"s)) == (vector<int>{4}), "Minus words must apply to phrase queries");
+    ASSERT_HINT(get_ids(server.FindTopDocuments("кот -\"пушистый кот\""s)) == (vector<int>{2, 3}), "Minus phrase must exclude only documents containing it");
+    // Стоп-слова не занимают позиций ни в документах, ни во фразах
+    ASSERT_HINT(get_ids(server.FindTopDocuments("\"кот и модный\""s)) == (vector<int>{1}), "Stop words must be skipped inside phrases");
+
+    // Слова фразы ранжируются как обычные плюс-слова
+    const auto find_relevance = [](const vector<Document>& documents, int document_id) {
+        return find_if(documents.begin(), documents.end(), [document_id](const Document& document) {
+            return document.id == document_id;
+        })->relevance;
+    };
+    ASSERT_HINT(abs(find_relevance(server.FindTopDocuments("\"пушистый кот\""s), 1)
+                    - find_relevance(server.FindTopDocuments("пушистый кот"s), 1)) < RELEVANCE_EPSILON,
+                "Phrase words must contribute the usual relevance");
+
+    const auto [words_1, status_1] = server.MatchDocument("\"пушистый кот\""s, 1);
+    ASSERT_EQUAL_HINT(words_1.size(), 2, "Matching document must report phrase words");
+    const auto [words_3, status_3] = server.MatchDocument("\"пушистый кот\""s, 3);
+    ASSERT_HINT(words_3.empty(), "Document without the phrase must not match");
+
+    const SearchServer copy(server);
+    server.RemoveDocument(4);
+    ASSERT_HINT(get_ids(server.FindTopDocuments("\"пушистый кот\""s)) == (vector<int>{1}), "Removed documents must leave position lists");
+    ASSERT_HINT(get_ids(copy.FindTopDocuments("\"пушистый кот\""s)) == (vector<int>{1, 4}), "Copy must keep positions");
+    SearchServer moved("и"s);
+    moved.EnablePositions();
+    moved.AddDocumentsFrom(copy, [](int document_id) {
+        return document_id >= 3;
+    });
+    ASSERT_HINT(get_ids(moved.FindTopDocuments("\"пушистый кот\"~1"s)) == (vector<int>{3, 4}), "Transferred documents must keep positions");
+
+    // Частые слова: пересечение позиций должно находить пары в длинных документах
+    string long_text;
+    for (int i = 0; i < 500; ++i) {
+        long_text += "a b "s;
     }
+    long_text += "c"s;
+    SearchServer long_server;
+    long_server.EnablePositions();
+    long_server.AddDocuments(vector<RawDocument>{{7, long_text, DocumentStatus::ACTUAL, {1}}});
+    ASSERT_EQUAL_HINT(long_server.FindTopDocuments("\"a b c\""s).size(), 1, "Phrase at the end of a long document must be found");
+    ASSERT_HINT(long_server.FindTopDocuments("\"a c\""s).empty(), "Phrase with wrong adjacency must not be found");
+    ASSERT_EQUAL_HINT(long_server.FindTopDocuments("\"a c\"~1"s).size(), 1, "Proximity must bridge a single word");
 
-    // Затем убеждаемся, что поиск этого же слова, входящего в список стоп-слов,
-    // возвращает пустой результат
-    {
-        SearchServer server("in the"s);
-        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
-        ASSERT_HINT(server.FindTopDocuments("in"s).empty(), "Must be empty");
+    const auto expect_invalid = [&server](const string& query, const string& hint) {
+        bool is_thrown = false;
+        try {
+            server.FindTopDocuments(query);
+        } catch (const invalid_argument&) {
+            is_thrown = true;
+        }
+        ASSERT_HINT(is_thrown, hint);
+    };
+    expect_invalid("\"пушистый кот"s, "Unclosed phrase must be rejected");
+    expect_invalid("\"кот\"~"s, "Proximity without a number must be rejected");
+    expect_invalid("\"\" кот"s, "Empty phrase must be rejected");
+    expect_invalid("\"кот -пёс\""s, "Minus words inside phrases must be rejected");
+
+    SearchServer plain;
+    plain.AddDocument(1, "пушистый кот"s, DocumentStatus::ACTUAL, {1});
+    bool is_thrown = false;
+    try {
+        plain.FindTopDocuments("\"пушистый кот\""s);
+    } catch (const invalid_argument&) {
+        is_thrown = true;
     }
-}
+    ASSERT_HINT(is_thrown, "Phrase search must require positions");
+    is_thrown = false;
+    try {
+        plain.EnablePositions();
+    } catch (const invalid_argument&) {
+        is_thrown = true;
+    }
+    ASSERT_HINT(is_thrown, "Positions must be enabled before adding documents");
 
-void TestMinusWordAddition () {
-    SearchServer server;
-    const vector<int> ratings = {0};
-    server.AddDocument(0, "cat with fur"s, DocumentStatus::ACTUAL, ratings);
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat").size(), 1, "Must have 1 result");
-    ASSERT_HINT(server.FindTopDocuments("cat -fur").empty(), "Must be empty");
+    // Обёртки над несколькими серверами позиций не хранят и отклоняют фразы
+    ShardedSearchServer sharded(""s, 2);
+    SegmentedSearchServer segmented(""s, 2);
+    for (int id = 0; id < 5; ++id) {
+        sharded.AddDocument(id, "cat dog"s, DocumentStatus::ACTUAL, {1});
+        segmented.AddDocument(id, "cat dog"s, DocumentStatus::ACTUAL, {1});
+    }
+    is_thrown = false;
+    try {
+        sharded.FindTopDocuments("\"cat dog\""s);
+    } catch (const invalid_argument&) {
+        is_thrown = true;
+    }
+    ASSERT_HINT(is_thrown, "Sharded search must reject phrases");
+    is_thrown = false;
+    try {
+        segmented.FindTopDocuments("\"cat dog\""s);
+    } catch (const invalid_argument&) {
+        is_thrown = true;
+    }
+    ASSERT_HINT(is_thrown, "Segmented search must reject phrases");
 }
 
-void TestDocumentMatching() {
+void TestAsyncSearch() {
+    {
+        QueryExecutor executor(3);
+        ASSERT_EQUAL_HINT(executor.GetThreadCount(), 3, "Executor must start the requested threads");
+        vector<future<int>> squares;
+        for (int i = 0; i < 100; ++i) {
+            squares.push_back(executor.Submit([i] {
+                return i * i;
+            }));
+        }
+        int sum = 0;
+        for (future<int>& square : squares) {
+            sum += square.get();
+        }
+        ASSERT_EQUAL_HINT(sum, 328350, "Executor must run every task once");
+        // Задача из потока пула попадает в его очередь и может быть украдена другим потоком
+        auto outer = executor.Submit([&executor] {
+            return executor.Submit([] {
+                return 7;
+            });
+        });
+        ASSERT_EQUAL_HINT(outer.get().get(), 7, "Tasks submitted from workers must run");
+        auto failing = executor.Submit([]() -> int {
+            throw runtime_error("failure"s);
+        });
+        bool is_thrown = false;
+        try {
+            failing.get();
+        } catch (const runtime_error&) {
+            is_thrown = true;
+        }
+        ASSERT_HINT(is_thrown, "Task exceptions must reach the future");
+    }
+
     SearchServer server;
-    const vector<int> ratings = {0};
-    server.AddDocument(0, "cat with fur"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(1, "cat with hat"s, DocumentStatus::ACTUAL, ratings);
-    tuple<vector<string>, DocumentStatus> answer = server.MatchDocument("cat fur"s, 0);
-    ASSERT_HINT((get<0>(answer)[0] == "cat"s && get<0>(answer)[1] == "fur"s && get<0>(answer).size() == 2), "Must have 2 elements in the vector");
-    tuple<vector<string>, DocumentStatus> answer_empty = server.MatchDocument("cat -hat"s, 1);
-    ASSERT_HINT(get<0>(answer_empty).empty(), "Must be empty");
-}
+    for (int id = 0; id < 300; ++id) {
+        server.AddDocument(id, id % 3 == 0 ? "cat dog"s : "cat"s, DocumentStatus::ACTUAL, {id});
+    }
+    server.AddDocument(300, "bird"s, DocumentStatus::BANNED, {1});
+    server.SetExecutor(make_shared<QueryExecutor>(2));
 
-void TestRelevanceSorting() {
-    SearchServer server("и в на"s);
-    const vector<int> ratings = {0};
-    server.AddDocument(0, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(2, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, ratings);
-    const auto found_docs = server.FindTopDocuments("пушистый ухоженный кот"s);
-    ASSERT_HINT((found_docs[0].relevance > found_docs[1].relevance && found_docs[1].relevance > found_docs[2].relevance), "Relevance sorting must go highest to lowest");
-}
+    const auto expected = server.FindTopDocuments("cat dog"s);
+    const AsyncSearchResult result = server.FindTopDocumentsAsync("cat dog"s).get();
+    ASSERT_HINT(result.is_complete, "Unlimited search must complete");
+    ASSERT_EQUAL_HINT(result.documents.size(), expected.size(), "Async search must match the blocking one");
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQUAL_HINT(result.documents[i].id, expected[i].id, "Async search must rank documents equally");
+    }
 
-void TestRatingCounting () {
-    SearchServer server;
-    const vector<int> ratings = {2, 61, 42};
-    server.AddDocument(0, "белый кот"s, DocumentStatus::ACTUAL, ratings);
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("белый кот"s)[0].rating, 35, "Document ID must be 35");
-}
+    AsyncSearchOptions banned;
+    banned.status = DocumentStatus::BANNED;
+    banned.deadline = chrono::steady_clock::now() + chrono::hours(1);
+    ASSERT_EQUAL_HINT(server.FindTopDocumentsAsync("bird"s, banned).get().documents.size(), 1, "Options must select the status");
 
-void TestRelevanceCounting () {
-    SearchServer server("и в на"s);
-    const vector<int> ratings = {0};
-    server.AddDocument(0, "белый кот и модный ошейник"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(1, "пушистый кот пушистый хвост"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(2, "ухоженный пёс выразительные глаза"s, DocumentStatus::ACTUAL, ratings);
-    const auto found_docs = server.FindTopDocuments("пушистый ухоженный кот"s);
-    ASSERT_HINT((round(found_docs[0].relevance * 1000000) == 650672 && round(found_docs[1].relevance * 1000000) == 274653 && round(found_docs[2].relevance * 1000000) == 101366), "Relevance must be calculated correctly");
+    AsyncSearchOptions cancelled;
+    cancelled.cancellation.Cancel();
+    const AsyncSearchResult cancelled_result = server.FindTopDocumentsAsync("cat"s, cancelled).get();
+    ASSERT_HINT(!cancelled_result.is_complete && cancelled_result.documents.empty(), "Cancelled search must not run");
+
+    // Истёкший срок оставляет только первый блок вхождений
+    AsyncSearchOptions expired;
+    expired.deadline = chrono::steady_clock::now() - chrono::seconds(1);
+    expired.max_result_count = 1000;
+    const AsyncSearchResult partial = server.FindTopDocumentsAsync("cat"s, expired).get();
+    ASSERT_HINT(!partial.is_complete, "Expired search must be reported as partial");
+    ASSERT_EQUAL_HINT(partial.documents.size(), PostingList::BLOCK_SIZE, "Expired search must stop after the first block");
+    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s, DocumentStatus::ACTUAL, 1000).size(), 300, "Limits must not outlive the async search");
+
+    bool is_thrown = false;
+    try {
+        server.FindTopDocumentsAsync("cat --dog"s).get();
+    } catch (const invalid_argument&) {
+        is_thrown = true;
+    }
+    ASSERT_HINT(is_thrown, "Query errors must reach the future");
 }
 
-void TestKeyMapperSort() {
+void TestOrdinalCompaction() {
+    // Ежедневная смена документов: удалённых номеров набирается больше половины
     SearchServer server;
-    const vector<int> ratings = {0};
-    server.AddDocument(0, "dog"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(1, "dog"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(2, "dog"s, DocumentStatus::REMOVED, ratings);
-    server.AddDocument(3, "dog"s, DocumentStatus::BANNED, ratings);
-    {
-    const auto found_docs = server.FindTopDocuments("dog"s, [] (
-    [[maybe_unused]]const int& doc_id, [[maybe_unused]]const DocumentStatus& doc_status, [[maybe_unused]]const int& rating
-    ) {
-        return doc_id % 2 == 0 && doc_status == DocumentStatus::REMOVED;
-    });
-    ASSERT_EQUAL_HINT(found_docs[0].id, 2, "Document ID must be 2");
+    server.EnablePositions();
+    SearchServer expected;
+    expected.EnablePositions();
+    const vector<string> texts = {"fluffy cat"s, "fluffy dog with collar"s, "cat with collar"s, "dog"s};
+    int next_id = 0;
+    for (int day = 0; day < 5; ++day) {
+        for (int i = 0; i < 200; ++i, ++next_id) {
+            const DocumentStatus status = next_id % 7 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+            server.AddDocument(next_id, texts[next_id % texts.size()], status, {next_id % 10});
+        }
+        for (int id = next_id - 200; id < next_id - 20; ++id) {
+            server.RemoveDocument(id);
+        }
     }
-    {
-    const auto found_docs = server.FindTopDocuments("dog"s, [] (
-    [[maybe_unused]]const int& doc_id, [[maybe_unused]]const DocumentStatus& doc_status, [[maybe_unused]]const int& rating
-    ) {
-        return doc_id % 2 == 0 && doc_status != DocumentStatus::REMOVED;
-    });
-    ASSERT_EQUAL_HINT(found_docs[0].id, 0, "Document ID must be 0");
+    for (int index = 0; index < server.GetDocumentCount(); ++index) {
+        const int document_id = server.GetDocumentId(index);
+        const auto [words, status] = server.MatchDocument("fluffy cat dog with collar"s, document_id);
+        expected.AddDocument(document_id, texts[document_id % texts.size()], status, {document_id % 10});
     }
-        {
-    const auto found_docs = server.FindTopDocuments("dog"s, [] (
-    [[maybe_unused]]const int& doc_id, [[maybe_unused]]const DocumentStatus& doc_status, [[maybe_unused]]const int& rating
-    ) {
-        return doc_id % 2 == 0 && doc_status == DocumentStatus::BANNED;
-    });
-    ASSERT_HINT(found_docs.empty(), "Must be empty");
+    ASSERT_EQUAL_HINT(server.GetDocumentCount(), 5 * 20, "Only the last documents of each day must remain");
+    ASSERT_EQUAL_HINT(server.GetStatusMask(DocumentStatus::BANNED).Count(), expected.GetStatusMask(DocumentStatus::BANNED).Count(),
+                      "Status masks must follow renumbered documents");
+    for (const string& query : {"fluffy cat"s, "collar -dog"s, "\"fluffy dog\""s, "with"s}) {
+        for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED}) {
+            const auto found = server.FindTopDocuments(query, status, 1000);
+            const auto found_parallel = server.FindTopDocuments(execution::par, query, status, 1000);
+            const auto reference = expected.FindTopDocuments(query, status, 1000);
+            ASSERT_EQUAL_HINT(found.size(), reference.size(), "Compaction must keep every live document");
+            ASSERT_EQUAL_HINT(found_parallel.size(), reference.size(), "Parallel search must see compacted documents");
+            for (size_t i = 0; i < found.size(); ++i) {
+                ASSERT_EQUAL_HINT(found[i].id, reference[i].id, "Compaction must keep the ranking");
+                ASSERT_EQUAL_HINT(found_parallel[i].id, reference[i].id, "Parallel search must keep the ranking");
+                ASSERT_HINT(abs(found[i].relevance - reference[i].relevance) < RELEVANCE_EPSILON, "Compaction must keep relevance");
+            }
+        }
     }
 }
 
-void TestDocumentStatus () {
-    SearchServer server;
-    const vector<int> ratings = {0};
-    server.AddDocument(0, "dog"s, DocumentStatus::ACTUAL, ratings);
-    server.AddDocument(1, "dog"s, DocumentStatus::IRRELEVANT, ratings);
-    server.AddDocument(2, "dog"s, DocumentStatus::REMOVED, ratings);
-    server.AddDocument(3, "dog"s, DocumentStatus::BANNED, ratings);
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::ACTUAL)[0].id, 0, "Document ID must be 0");
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::IRRELEVANT)[0].id,1, "Document ID must be 1");
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::REMOVED)[0].id, 2, "Document ID must be 2");
-    ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s, DocumentStatus::BANNED)[0].id, 3, "Document ID must be 3");
+void TestLogDuration() {
+    ostringstream out;
+    {
+        LOG_DURATION_STREAM("outer"s, out);
+        LOG_DURATION_STREAM("inner"s, out);
+    }
+#if defined(NDEBUG) && !defined(SEARCH_SERVER_PROFILE)
+    ASSERT_HINT(out.str().empty(), "Release build must compile the timers out");
+#else
+    // Замеры печатаются при выходе из области видимости, в обратном порядке
+    const string text = out.str();
+    ASSERT_HINT(text.rfind("inner: "s, 0) == 0, "Inner timer must be printed first");
+    ASSERT_HINT(text.find("\nouter: "s) != string::npos, "Every timer in a scope must be printed");
+    ASSERT_HINT(text.size() >= 4 && text.compare(text.size() - 4, 4, " ms\n"s) == 0, "Duration must be printed in ms");
+#endif
 }
 
 /*
@@ -506,6 +6284,38 @@ void TestSearchServer() {
     RUN_TEST(TestRelevanceCounting);
     RUN_TEST(TestKeyMapperSort);
     RUN_TEST(TestDocumentStatus);
+    RUN_TEST(TestPostingsOutOfOrderIds);
+    RUN_TEST(TestParallelFindTopDocuments);
+    RUN_TEST(TestProcessQueries);
+    RUN_TEST(TestTopDocumentsLimit);
+    RUN_TEST(TestStringViewTokenization);
+    RUN_TEST(TestPreparsedQuery);
+    RUN_TEST(TestParallelMatchDocument);
+    RUN_TEST(TestRemoveDocument);
+    RUN_TEST(TestRemoveDuplicates);
+    RUN_TEST(TestInverseDocumentFreqUpdates);
+    RUN_TEST(TestAddDocumentsBatch);
+    RUN_TEST(TestIndexSnapshot);
+    RUN_TEST(TestShardedSearchServer);
+    RUN_TEST(TestVersionedSearchServer);
+    RUN_TEST(TestStatusMasks);
+    RUN_TEST(TestDenseScoreAccumulator);
+    RUN_TEST(TestScoringKernels);
+    RUN_TEST(TestCompressedPostings);
+    RUN_TEST(TestPrunedTopDocuments);
+    RUN_TEST(TestQueryResultCache);
+    RUN_TEST(TestRequestQueue);
+    RUN_TEST(TestBenchmarkCorpus);
+    RUN_TEST(TestSearchMetrics);
+    RUN_TEST(TestQueryArena);
+    RUN_TEST(TestSegmentedSearchServer);
+    RUN_TEST(TestCorpusLoader);
+    RUN_TEST(TestCompileTimePredicates);
+    RUN_TEST(TestStopWordSet);
+    RUN_TEST(TestPhraseQueries);
+    RUN_TEST(TestAsyncSearch);
+    RUN_TEST(TestOrdinalCompaction);
+    RUN_TEST(TestLogDuration);
     // Не забудьте вызывать остальные тесты здесь
 }
 
@@ -517,12 +6327,12 @@ void PrintDocument(const Document& document) {
          << "rating = "s << document.rating << " }"s << endl;
 }
 
-void PrintMatchDocumentResult(int document_id, const vector<string>& words, DocumentStatus status) {
+void PrintMatchDocumentResult(int document_id, const vector<string_view>& words, DocumentStatus status) {
     cout << "{ "s
          << "document_id = "s << document_id << ", "s
          << "status = "s << static_cast<int>(status) << ", "s
          << "words ="s;
-    for (const string& word : words) {
+    for (const string_view word : words) {
         cout << ' ' << word;
     }
     cout << "}"s << endl;
@@ -548,9 +6358,11 @@ void FindTopDocuments(const SearchServer& search_server, const string& raw_query
     }
 }
 
-void MatchDocuments(const SearchServer& search_server, const string& query) {
+void MatchDocuments(const SearchServer& search_server, const string& raw_query) {
     try {
-        cout << "Матчинг документов по запросу: "s << query << endl;
+        cout << "Матчинг документов по запросу: "s << raw_query << endl;
+        // Запрос разбирается один раз для всех документов
+        const SearchServer::Query query = search_server.ParseQuery(raw_query);
         const int document_count = search_server.GetDocumentCount();
         for (int index = 0; index < document_count; ++index) {
             const int document_id = search_server.GetDocumentId(index);
@@ -558,12 +6370,106 @@ void MatchDocuments(const SearchServer& search_server, const string& query) {
             PrintMatchDocumentResult(document_id, words, status);
         }
     } catch (const exception& e) {
-        cout << "Ошибка матчинга документов на запрос "s << query << ": "s << e.what() << endl;
+        cout << "Ошибка матчинга документов на запрос "s << raw_query << ": "s << e.what() << endl;
     }
 }
 
-int main() {
-    
+// ==================== бенчмарк =========================
+// Каждая операция замеряется целиком на синтетическом корпусе. Контрольная сумма
+// результатов печатается, чтобы вызовы не выбрасывались оптимизатором
+void RunBenchmarks(const CorpusConfig& config, ostream& out) {
+    CorpusGenerator generator(config);
+    const vector<string> texts = generator.GenerateDocuments();
+    const vector<string> queries = generator.GenerateQueries();
+    // Самые частые слова словаря служат стоп-словами
+    const vector<string>& vocabulary = generator.GetVocabulary();
+    const vector<string> stop_words(vocabulary.begin(), vocabulary.begin() + min<size_t>(10, vocabulary.size()));
+    const auto get_status = [](int document_id) {
+        return document_id % 4 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+    };
+    out << "documents: "s << texts.size() << ", queries: "s << queries.size()
+        << ", vocabulary: "s << vocabulary.size() << endl;
+
+    size_t checksum = 0;
+    SearchServer server(stop_words);
+    {
+        LogDuration guard("AddDocument"s, out);
+        for (size_t i = 0; i < texts.size(); ++i) {
+            const int document_id = static_cast<int>(i);
+            server.AddDocument(document_id, texts[i], get_status(document_id), {document_id % 10});
+        }
+    }
+    {
+        vector<RawDocument> batch;
+        batch.reserve(texts.size());
+        for (size_t i = 0; i < texts.size(); ++i) {
+            const int document_id = static_cast<int>(i);
+            batch.push_back({document_id, texts[i], get_status(document_id), {document_id % 10}});
+        }
+        SearchServer batch_server(stop_words);
+        LogDuration guard("AddDocuments par"s, out);
+        batch_server.AddDocuments(execution::par, batch);
+        checksum += batch_server.GetDocumentCount();
+    }
+    {
+        LogDuration guard("FindTopDocuments seq"s, out);
+        for (const string& query : queries) {
+            checksum += server.FindTopDocuments(execution::seq, query).size();
+        }
+    }
+    {
+        LogDuration guard("FindTopDocuments par"s, out);
+        for (const string& query : queries) {
+            checksum += server.FindTopDocuments(execution::par, query).size();
+        }
+    }
+    {
+        LogDuration guard("ProcessQueries"s, out);
+        for (const vector<Document>& documents : ProcessQueries(server, queries)) {
+            checksum += documents.size();
+        }
+    }
+    const int document_count = server.GetDocumentCount();
+    if (document_count > 0) {
+        {
+            LogDuration guard("MatchDocument seq"s, out);
+            for (size_t i = 0; i < queries.size(); ++i) {
+                const auto [words, status] = server.MatchDocument(execution::seq, queries[i], static_cast<int>(i) % document_count);
+                checksum += words.size();
+            }
+        }
+        {
+            LogDuration guard("MatchDocument par"s, out);
+            for (size_t i = 0; i < queries.size(); ++i) {
+                const auto [words, status] = server.MatchDocument(execution::par, queries[i], static_cast<int>(i) % document_count);
+                checksum += words.size();
+            }
+        }
+    }
+    {
+        const int removed_count = min(document_count, static_cast<int>(queries.size()));
+        LogDuration guard("RemoveDocument"s, out);
+        for (int document_id = 0; document_id < removed_count; ++document_id) {
+            server.RemoveDocument(document_id);
+        }
+    }
+    checksum += server.GetDocumentCount();
+    out << "checksum: "s << checksum << endl;
+}
+
+// С аргументом --benchmark вместо тестов и примера запускаются бенчмарки,
+// остальные аргументы задают корпус (см. ParseCorpusConfig)
+int main(int argc, char* argv[]) {
+    if (argc > 1 && argv[1] == "--benchmark"sv) {
+        try {
+            RunBenchmarks(ParseCorpusConfig(vector<string_view>(argv + 2, argv + argc)), cout);
+        } catch (const exception& e) {
+            cerr << "Ошибка бенчмарка: "s << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
     TestSearchServer();
 
     SearchServer search_server("и в на"s);